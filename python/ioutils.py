@@ -29,8 +29,9 @@ class SimResult(object):
         self.timestep: float
 
 
-def process_tmp(tmp: str):
+def process_tmp(tmp: str, dim: int = 2, res: int = 64):
     logger.info(f"Loading from {tmp}")
+    grid_shape = (res + 1,) * dim
 
     def process_valuekey(fullpath: str, valuekey: str):
         if valuekey == "timestep":
@@ -38,19 +39,19 @@ def process_tmp(tmp: str):
             return timestep
         if valuekey == "x":
             x = np.loadtxt(fullpath)
-            x = x.reshape(len(x) // 2, 2)
+            x = x.reshape(len(x) // dim, dim)
             return x
         if valuekey == "v":
             v = np.loadtxt(fullpath)
-            v = v.reshape(len(v) // 2, 2)
+            v = v.reshape(len(v) // dim, dim)
             return v
         if valuekey == "F":
             F = np.loadtxt(fullpath)
-            F = F.reshape(F.shape[0] // 2, 2, 2)
+            F = F.reshape(F.shape[0] // dim, dim, dim)
             return F
         if valuekey == "C":
             C = np.loadtxt(fullpath)
-            C = C.reshape(C.shape[0] // 2, 2, 2)
+            C = C.reshape(C.shape[0] // dim, dim, dim)
             return C
         if valuekey == "Jp":
             Jp = np.loadtxt(fullpath)
@@ -59,15 +60,13 @@ def process_tmp(tmp: str):
             lame = np.loadtxt(fullpath)
             return lame
         if valuekey == "mass":
-            res = 65
             mass = np.loadtxt(fullpath)
-            mass = mass.reshape(res, res)
+            mass = mass.reshape(grid_shape)
             return mass
 
         if valuekey == "velocity":
-            res = 65
             velocity = np.loadtxt(fullpath)
-            velocity = velocity.reshape(res, res, 2)
+            velocity = velocity.reshape(grid_shape + (dim,))
             return velocity
         else:
             logger.error(f"ValueKey {valuekey} is invalid")
@@ -0,0 +1,270 @@
+#include "nclr.h"
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <string>
+#include <vector>
+
+namespace py = pybind11;
+
+namespace {
+    using real = nclr::real;
+    using RealArray = py::array_t<real, py::array::c_style | py::array::forcecast>;
+
+    // Byte offset of a field inside a struct, the views stride over the simulation's vectors with it
+    template<typename Struct, typename Member>
+    auto member_offset(const Struct &instance, const Member Struct::*member) -> py::ssize_t {
+        return reinterpret_cast<const char *>(&(instance.*member)) - reinterpret_cast<const char *>(&instance);
+    }
+
+    /**
+     * Read-only NumPy array over memory owned by the simulation. `owner` becomes the array's base, so the
+     * simulation stays alive as long as any view of it does.
+     */
+    auto view(const void *data, std::vector<py::ssize_t> shape, std::vector<py::ssize_t> strides, py::handle owner)
+            -> py::array {
+        py::array array(py::dtype::of<real>(), std::move(shape), std::move(strides), data, owner);
+        array.attr("setflags")(py::arg("write") = false);
+        return array;
+    }
+
+    /**
+     * View of one particle field, shaped (n, *field_shape), striding over the Particle structs in place. Eigen
+     * matrices are column major, so C uses strides that make array[p, r, c] == C(r, c). The particle list is
+     * reallocated whenever a step emits, splits, merges or deletes particles, which leaves earlier views pointing
+     * at freed memory, so they are only valid until the next advance() that changes the particle count.
+     */
+    template<int dim, typename Member>
+    auto particle_view(py::object self, const Member nclr::Particle<dim>::*member,
+                       std::vector<py::ssize_t> field_shape, std::vector<py::ssize_t> field_strides) -> py::array {
+        const auto &particles = self.cast<const nclr::MPMSimulation<dim> &>().particles();
+        const nclr::Particle<dim> probe(nclr::constvec<dim>(0), 0);
+
+        std::vector<py::ssize_t> shape{py::ssize_t(particles.size())};
+        std::vector<py::ssize_t> strides{py::ssize_t(sizeof(nclr::Particle<dim>))};
+        shape.insert(shape.end(), field_shape.begin(), field_shape.end());
+        strides.insert(strides.end(), field_strides.begin(), field_strides.end());
+
+        const char *data = reinterpret_cast<const char *>(particles.data()) + member_offset(probe, member);
+        return view(data, shape, strides, self);
+    }
+
+    /**
+     * View of the deformation gradients, shaped (n, dim, dim) like C in particle_view(), with the same lifetime.
+     * Liquids don't track F, so theirs is a read-only array of identities owned by NumPy instead.
+     */
+    template<int dim>
+    auto deformation_view(py::object self) -> py::array {
+        const auto &sim = self.cast<const nclr::MPMSimulation<dim> &>();
+        const auto &deformations = sim.deformations();
+        const py::ssize_t n = py::ssize_t(sim.particles().size());
+        if (deformations.empty()) {
+            py::array_t<real> identity({n, py::ssize_t(dim), py::ssize_t(dim)});
+            auto entries = identity.template mutable_unchecked<3>();
+            for (py::ssize_t pp = 0; pp < n; ++pp) {
+                for (int rr = 0; rr < dim; ++rr) {
+                    for (int cc = 0; cc < dim; ++cc) { entries(pp, rr, cc) = rr == cc ? 1 : 0; }
+                }
+            }
+            identity.attr("setflags")(py::arg("write") = false);
+            return identity;
+        }
+
+        constexpr py::ssize_t kReal = sizeof(real);
+        return view(deformations.data()->data(), {n, py::ssize_t(dim), py::ssize_t(dim)},
+                    {py::ssize_t(sizeof(nclr::Matrix<real, dim>)), kReal, dim * kReal}, self);
+    }
+
+    /**
+     * View of one grid field, shaped (res + 1, ..., res + 1, *field_shape) in the grid's x-major order. The grid
+     * keeps its size, and p2g() refills it in place, so its storage never moves once the first step allocated it.
+     */
+    template<int dim, typename Member>
+    auto grid_view(py::object self, const Member nclr::Cell<dim>::*member, std::vector<py::ssize_t> field_shape,
+                   std::vector<py::ssize_t> field_strides) -> py::array {
+        const auto &sim = self.cast<const nclr::MPMSimulation<dim> &>();
+        const nclr::Cell<dim> probe;
+
+        std::vector<py::ssize_t> shape(dim, sim.res() + 1);
+        std::vector<py::ssize_t> strides(dim);
+        py::ssize_t stride = sizeof(nclr::Cell<dim>);
+        for (int dd = dim - 1; dd >= 0; --dd) {
+            strides.at(dd) = stride;
+            stride *= sim.res() + 1;
+        }
+        shape.insert(shape.end(), field_shape.begin(), field_shape.end());
+        strides.insert(strides.end(), field_strides.begin(), field_strides.end());
+
+        // The grid is only allocated by the first step
+        if (sim.grid().empty()) {
+            py::array_t<real> zeros(shape);
+            zeros.attr("fill")(0);
+            return zeros;
+        }
+
+        const char *data = reinterpret_cast<const char *>(sim.grid().data()) + member_offset(probe, member);
+        return view(data, shape, strides, self);
+    }
+
+    template<int dim>
+    auto make_simulation(const RealArray &x, const std::optional<RealArray> &v, nclr::MaterialModel model, int res,
+                         real dt, real E, real nu, real gravity, real extent, int color)
+            -> std::unique_ptr<nclr::MPMSimulation<dim>> {
+        if (x.ndim() != 2 || x.shape(1) != dim) {
+            throw py::value_error("x must have shape (n, " + std::to_string(dim) + ")");
+        }
+        if (v && (v->ndim() != 2 || v->shape(0) != x.shape(0) || v->shape(1) != dim)) {
+            throw py::value_error("v must have the same shape as x");
+        }
+        if (res <= 2 * nclr::MPMSimulation<dim>::kBoundary || dt <= 0 || extent <= 0) {
+            throw py::value_error("res must exceed the boundary layer, dt and extent must be positive");
+        }
+
+        const auto positions = x.template unchecked<2>();
+        std::vector<nclr::Particle<dim>> particles;
+        particles.reserve(positions.shape(0));
+        for (py::ssize_t pp = 0; pp < positions.shape(0); ++pp) {
+            nclr::Vector<real, dim> position;
+            for (int dd = 0; dd < dim; ++dd) { position(dd) = positions(pp, dd); }
+            particles.emplace_back(position, color);
+        }
+
+        if (v) {
+            const auto velocities = v->template unchecked<2>();
+            for (py::ssize_t pp = 0; pp < velocities.shape(0); ++pp) {
+                for (int dd = 0; dd < dim; ++dd) { particles.at(pp).v(dd) = velocities(pp, dd); }
+            }
+        }
+
+        return std::make_unique<nclr::MPMSimulation<dim>>(std::move(particles), model, res, dt, E, nu, gravity,
+                                                          extent);
+    }
+
+    template<int dim>
+    auto bind_simulation(py::module_ &m, const char *name) -> void {
+        using Sim = nclr::MPMSimulation<dim>;
+        using Particle = nclr::Particle<dim>;
+        constexpr py::ssize_t kReal = sizeof(real);
+
+        py::class_<Sim>(m, name)
+                .def(py::init(&make_simulation<dim>), py::arg("x"), py::arg("v") = py::none(),
+                     py::arg("model") = nclr::MaterialModel::kJelly, py::arg("res") = 64, py::arg("dt") = 1e-4,
+                     py::arg("E") = 1e4, py::arg("nu") = 0.2, py::arg("gravity") = -100.0, py::arg("extent") = 1.0,
+                     py::arg("color") = 0)
+                .def(
+                        "advance",
+                        [](Sim &sim, int steps) -> void {
+                            for (int step = 0; step < steps; ++step) { sim.advance(); }
+                        },
+                        py::arg("steps") = 1, py::call_guard<py::gil_scoped_release>(),
+                        "Runs `steps` steps without holding the GIL. Other Python threads keep running, but must not "
+                        "read the particle or grid views meanwhile, since the worker threads are writing them")
+                .def(
+                        "advance",
+                        [](Sim &sim, int steps, int callback_every, const py::function &callback) -> void {
+                            py::gil_scoped_release release;
+                            sim.advance(steps, callback_every, [&](int step, const Sim &) -> void {
+                                py::gil_scoped_acquire acquire;
+                                callback(step);
+                            });
+                        },
+                        py::arg("steps"), py::arg("callback_every"), py::arg("callback"),
+                        "Runs `steps` steps without holding the GIL, calling callback(step) every `callback_every` "
+                        "steps and once more after the last one. The callback holds the GIL between two steps, where "
+                        "the views are consistent, so copy them there for other threads")
+                .def("set_escape_policy", &Sim::set_escape_policy)
+                .def("set_sleeping", &Sim::set_sleeping)
+                .def("set_adaptive", &Sim::set_adaptive)
+                .def("set_refinement", &Sim::set_refinement)
+                .def("set_threads", &Sim::set_threads)
+                .def_property_readonly("x",
+                                       [](py::object self) {
+                                           return particle_view<dim>(self, &Particle::x, {dim}, {kReal});
+                                       })
+                .def_property_readonly("v",
+                                       [](py::object self) {
+                                           return particle_view<dim>(self, &Particle::v, {dim}, {kReal});
+                                       })
+                .def_property_readonly("F",
+                                       [](py::object self) { return deformation_view<dim>(self); },
+                                       "Deformation gradients, always the identity for liquids (see Jp)")
+                .def_property_readonly("C",
+                                       [](py::object self) {
+                                           return particle_view<dim>(self, &Particle::C, {dim, dim},
+                                                                      {kReal, dim * kReal});
+                                       })
+                .def_property_readonly(
+                        "Jp", [](py::object self) { return particle_view<dim>(self, &Particle::Jp, {}, {}); })
+                .def_property_readonly("grid_velocity",
+                                       [](py::object self) {
+                                           return grid_view<dim>(self, &nclr::Cell<dim>::velocity, {dim}, {kReal});
+                                       })
+                .def_property_readonly(
+                        "grid_mass",
+                        [](py::object self) { return grid_view<dim>(self, &nclr::Cell<dim>::mass, {}, {}); })
+                .def_property_readonly("num_particles", [](const Sim &sim) { return sim.particles().size(); })
+                .def_property_readonly("escaped_particles", &Sim::escaped_particles)
+                .def_property_readonly("sleeping_particles", &Sim::sleeping_particles)
+                .def_property_readonly("split_particles", &Sim::split_particles)
+                .def_property_readonly("merged_particles", &Sim::merged_particles)
+                .def_property_readonly("refined_blocks", &Sim::refined_blocks)
+                .def_property_readonly("res", &Sim::res)
+                .def_property_readonly("dt", &Sim::dt)
+                .def_property_readonly("dx", &Sim::dx)
+                .def_readonly("mu_0", &Sim::mu_0)
+                .def_readonly("lambda_0", &Sim::lambda_0);
+    }
+}// namespace
+
+/**
+ * Python module exposing MPMSimulation2D/3D. The particle and grid properties are read-only NumPy views of the
+ * simulation's own storage, with the simulation as their base, refreshed in place by every step. The grid never
+ * moves, but a step that emits, splits, merges or deletes particles reallocates the particle storage, and views
+ * taken before it then point at freed memory. advance() releases the GIL, so a Python thread reading views while
+ * another one steps sees the step in progress; readers on other threads should take copies in the callback of
+ * advance().
+ */
+PYBIND11_MODULE(nuclear_mpm, m) {
+    m.doc() = "NuclearMPM material point method solver";
+
+    py::enum_<nclr::MaterialModel>(m, "MaterialModel")
+            .value("snow", nclr::MaterialModel::kSnow)
+            .value("jelly", nclr::MaterialModel::kJelly)
+            .value("liquid", nclr::MaterialModel::kLiquid);
+
+    py::enum_<nclr::EscapePolicy>(m, "EscapePolicy")
+            .value("clamp", nclr::EscapePolicy::kClamp)
+            .value("delete", nclr::EscapePolicy::kDelete)
+            .value("count", nclr::EscapePolicy::kCount);
+
+    py::class_<nclr::SleepSettings>(m, "SleepSettings")
+            .def(py::init<>())
+            .def_readwrite("enabled", &nclr::SleepSettings::enabled)
+            .def_readwrite("velocity", &nclr::SleepSettings::velocity)
+            .def_readwrite("deformation", &nclr::SleepSettings::deformation)
+            .def_readwrite("steps", &nclr::SleepSettings::steps)
+            .def_readwrite("wake_velocity", &nclr::SleepSettings::wake_velocity);
+
+    py::class_<nclr::AdaptiveSettings>(m, "AdaptiveSettings")
+            .def(py::init<>())
+            .def_readwrite("enabled", &nclr::AdaptiveSettings::enabled)
+            .def_readwrite("every", &nclr::AdaptiveSettings::every)
+            .def_readwrite("split_strain", &nclr::AdaptiveSettings::split_strain)
+            .def_readwrite("merge_strain", &nclr::AdaptiveSettings::merge_strain)
+            .def_readwrite("split_levels", &nclr::AdaptiveSettings::split_levels)
+            .def_readwrite("merge_levels", &nclr::AdaptiveSettings::merge_levels)
+            .def_readwrite("spacing", &nclr::AdaptiveSettings::spacing)
+            .def_readwrite("max_particles", &nclr::AdaptiveSettings::max_particles);
+
+    py::class_<nclr::RefineSettings>(m, "RefineSettings")
+            .def(py::init<>())
+            .def_readwrite("enabled", &nclr::RefineSettings::enabled)
+            .def_readwrite("every", &nclr::RefineSettings::every)
+            .def_readwrite("strain", &nclr::RefineSettings::strain);
+
+    bind_simulation<2>(m, "MPMSimulation2D");
+    bind_simulation<3>(m, "MPMSimulation3D");
+}
@@ -1,7 +1,10 @@
-#include "nclr.h"
+#include "nclr_async.h"
 #include "taichi.h"// Packaged in the repo, not required for embedding
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <memory>
+#include <thread>
 
 // How many dimensions to run the sim in (2 or 3)
 constexpr int kDimension = 2;
@@ -18,6 +21,9 @@ constexpr nclr::real dt = 1e-4f;
 // Frame draw interval
 constexpr nclr::real frame_dt = 1e-3f;
 
+// Window redraw interval (about 60 Hz)
+constexpr auto kRedrawInterval = std::chrono::milliseconds(16);
+
 // The color to paint the points
 constexpr int kColor = 0xED553B;
 
@@ -46,39 +52,39 @@ int main() {
     auto sim = std::make_unique<MPMSimulation<kDimension>>(particles, MaterialModel::kSnow);
     /* auto sim = std::make_unique<MPMSimulation<kDimension>>(particles, MaterialModel::kJelly); */
 
-    // Main Loop
-    for (uint64_t frame = 0;; ++frame) {
-
-        // Advance simulation
-        sim->advance();
+    // Step on a worker thread, publishing a frame every frame_dt. Drawing never holds up the simulation.
+    AsyncSimulation<kDimension> runner(std::move(sim), int(frame_dt / dt));
 
-        // Visualize frame
-        if (frame % int(frame_dt / dt) == 0) {
+    // Main Loop
+    auto next_frame = std::chrono::steady_clock::now();
+    for (;;) {
+        // Newest snapshot, or the last one again if the simulation hasn't published since (nullptr before the first)
+        const Snapshot<kDimension> *snapshot = runner.latest();
 
-            // Clear background
-            canvas.clear(0x112F41);
+        // Clear background
+        canvas.clear(0x112F41);
 
-            // Boundary Condition Box
-            canvas.rect(taichi::Vector2(0.04), taichi::Vector2(0.96)).radius(2).color(0x4FB99F).close();
+        // Boundary Condition Box
+        canvas.rect(taichi::Vector2(0.04), taichi::Vector2(0.96)).radius(2).color(0x4FB99F).close();
 
+        for (std::size_t pp = 0; snapshot != nullptr && pp < snapshot->x.size(); ++pp) {
             if constexpr (kDimension == 3) {
-                for (const auto &p : sim->particles()) {
-                    // Scale the values coming out of the transform to 0-1 (your mileage _will_ vary)
-                    const Vector<real, 2> pt = pt_3d_to_2d(p.x) / 4;
+                // Scale the values coming out of the transform to 0-1 (your mileage _will_ vary)
+                const Vector<real, 2> pt = pt_3d_to_2d(snapshot->x[pp]) / 4;
 
-                    // Convert the point to a taichi primitive.
-                    const auto point = taichi::Vector2(pt);
-
-                    // Draw this circle
-                    canvas.circle(point).radius(2).color(p.c);
-                }
+                // Draw this circle
+                canvas.circle(taichi::Vector2(pt)).radius(2).color(snapshot->c[pp]);
             } else {
                 // Particles
-                for (const auto &p : sim->particles()) { canvas.circle(taichi::Vector2(p.x)).radius(2).color(p.c); }
+                canvas.circle(taichi::Vector2(snapshot->x[pp])).radius(2).color(snapshot->c[pp]);
             }
-
-            // Update image
-            gui.update();
         }
+
+        // Update image, which also keeps the window responsive while no new frame comes in
+        gui.update();
+
+        // Wait out the rest of the redraw interval instead of spinning on latest(), without catching up on slow frames
+        next_frame = std::max(next_frame + kRedrawInterval, std::chrono::steady_clock::now());
+        std::this_thread::sleep_until(next_frame);
     }
 }
@@ -1,9 +1,17 @@
+#pragma once
+
 #include "nclr_math.h"
 #include <Eigen/Dense>
 #include <Eigen/SVD>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -25,26 +33,36 @@ namespace nclr {
         // Velocity
         Vector<real, dim> v;
 
-        // Deformation gradient
-        Matrix<real, dim> F;
-
         // Affine momentum from APIC
         Matrix<real, dim> C;
 
         // Determinant of the deformation gradient (i.e. volume)
         real Jp;
 
+#ifdef NCLR_UNIFORM_MASS
+        // Mass (Shared by every particle, not stored)
+        constexpr static real mass = 1.0;
+
+        // Volume (Shared by every particle, not stored)
+        constexpr static real volume = 1.0;
+#else
         // Mass
         real mass;
 
         // Volume (Per-Particle)
         real volume;
+#endif
 
         // Color
         int c;
 
+#ifdef NCLR_UNIFORM_MASS
+        Particle(Vector<real, dim> x, int c, Vector<real, dim> v = constvec<dim>(0))
+            : x(x), v(v), C(constmat<dim>(0)), Jp(1.0), c(c) {}
+#else
         Particle(Vector<real, dim> x, int c, Vector<real, dim> v = constvec<dim>(0), real mass = 1.0, real volume = 1.0)
-            : x(x), v(v), F(diag<dim>(1)), C(constmat<dim>(0)), Jp(1.0), c(c), mass(mass), volume(volume) {}
+            : x(x), v(v), C(constmat<dim>(0)), Jp(1.0), mass(mass), volume(volume), c(c) {}
+#endif
     };
 
     template<int dim>
@@ -57,13 +75,277 @@ namespace nclr {
     enum class MaterialModel {
         kSnow = 0,
         kJelly,
+        // Pressure only, the volume ratio J is kept in Particle::Jp and F is never updated (it stays the identity)
         kLiquid,
     };
 
+    // What g2p() does with particles that leave the part of the domain the grid stencil can reach
+    enum class EscapePolicy {
+        // Move the particle back onto the nearest face and stop it along that axis
+        kClamp = 0,
+        // Remove the particle
+        kDelete,
+        // Leave the particle where it is, p2g() and g2p() skip it from then on
+        kCount,
+    };
+
+    enum class ColliderShape {
+        kPlane = 0,
+        kSphere,
+    };
+
+    template<int dim>
+    struct Collider {
+        ColliderShape shape;
+
+        // A point on the plane, or the center of the sphere
+        Vector<real, dim> position;
+
+        // Normal pointing out of the solid side of the plane (unused for spheres)
+        Vector<real, dim> normal;
+
+        // Radius of the sphere (unused for planes)
+        real radius;
+
+        // Sticky colliders stop grid nodes inside them, slip colliders only remove the inward velocity
+        bool sticky;
+
+        Collider(ColliderShape shape, Vector<real, dim> position, Vector<real, dim> normal = constvec<dim>(0),
+                 real radius = 0.0, bool sticky = true)
+            : shape(shape), position(position),
+              normal(normal.norm() > 0 ? Vector<real, dim>(normal.normalized()) : normal), radius(radius),
+              sticky(sticky) {}
+    };
+
+    // Box that new particles appear in at the start of every step, like a nozzle or a pouring spout
+    template<int dim>
+    struct Source {
+        Vector<real, dim> center;
+        Vector<real, dim> half_extent;
+
+        // Initial velocity of the emitted particles
+        Vector<real, dim> velocity;
+
+        // Particles emitted per step, at uniformly random positions in the box
+        int per_step;
+
+        // Color
+        int c;
+    };
+
+    // Particles that end a step on the solid side of a plane or inside a sphere are removed
+    template<int dim>
+    struct Sink {
+        ColliderShape shape;
+
+        // A point on the plane, or the center of the sphere
+        Vector<real, dim> position;
+
+        // Normal pointing away from the removed side of the plane (unused for spheres)
+        Vector<real, dim> normal;
+
+        // Radius of the sphere (unused for planes)
+        real radius;
+
+        Sink(ColliderShape shape, Vector<real, dim> position, Vector<real, dim> normal = constvec<dim>(0),
+             real radius = 0.0)
+            : shape(shape), position(position),
+              normal(normal.norm() > 0 ? Vector<real, dim>(normal.normalized()) : normal), radius(radius) {}
+
+        auto contains(const Vector<real, dim> &x) const -> bool {
+            if (shape == ColliderShape::kPlane) { return (x - position).dot(normal) < 0; }
+            return (x - position).norm() < radius;
+        }
+    };
+
+    /**
+     * Rest detection for scenes that settle. The grid is split into blocks of MPMSimulation::kSleepBlock cells per
+     * side, and a block whose particles all stayed below `velocity` (speed) and `deformation` (largest per-step
+     * change of an F entry) for `steps` consecutive steps falls asleep: its particles skip p2g() and g2p(), and
+     * the grid gets their cached mass with zero velocity instead. A sleeping block wakes when a grid node it
+     * touches would move faster than `wake_velocity`, or when particles are emitted or added inside it.
+     */
+    struct SleepSettings {
+        bool enabled = false;
+        real velocity = 0.05;
+        real deformation = 1e-4;
+        int steps = 100;
+        real wake_velocity = 0.5;
+    };
+
+    /**
+     * Adaptive particle resolution. Every `every` steps, particles in cells on the free surface or straining more
+     * than `split_strain` per step (largest entry of the symmetric part of dt C) are split in two, down to
+     * 2^-split_levels of the reference mass. Pairs of calm particles (strain below `merge_strain`) of the same mass
+     * in interior cells, at least two cells from the surface, merge into one, up to 2^merge_levels of it.
+     * `spacing` is the sampling distance of reference mass particles in cells, and `max_particles` (0 for no
+     * limit) caps the count that splitting may reach.
+     */
+    struct AdaptiveSettings {
+        bool enabled = false;
+        int every = 10;
+        real split_strain = 1e-3;
+        real merge_strain = 1e-4;
+        int split_levels = 1;
+        int merge_levels = 1;
+        real spacing = 0.5;
+        std::size_t max_particles = 0;
+    };
+
+    /**
+     * Two-level grid. Blocks of MPMSimulation::kRefineBlock cells that hold free surface cells, or particles
+     * straining more than `strain` per step (as in AdaptiveSettings), get a second grid at half the spacing. The
+     * refined set is rebuilt every `every` steps. Particles in refined blocks live on the fine grid and those in
+     * coarse blocks on the coarse one. In the ring of blocks around the refined ones a particle's share of the fine
+     * grid falls from 1 to 0 (see MPMSimulation::fine_share()), it scatters that share of its mass and momentum to
+     * the fine grid and the rest to the coarse one, and gathers the same blend back, which couples the levels and
+     * conserves momentum as particles cross between them.
+     */
+    struct RefineSettings {
+        bool enabled = false;
+        int every = 10;
+        real strain = 1e-3;
+    };
+
+    // Particle fields copied into a Snapshot besides the positions
+    struct SnapshotFields {
+        bool velocity = false;
+        bool deformation = false;
+        bool Jp = false;
+        bool color = true;
+    };
+
+    // Immutable copy of the particle state after `step` steps, fields that were not selected are left empty
+    template<int dim>
+    struct Snapshot {
+        std::size_t step = 0;
+        std::vector<Vector<real, dim>> x;
+        std::vector<Vector<real, dim>> v;
+        std::vector<Matrix<real, dim>> F;
+        std::vector<real> Jp;
+        std::vector<int> c;
+    };
+
+    /**
+     * One reader's feed of snapshots from MPMSimulation::add_snapshot_channel(). The simulation thread publishes
+     * into it, and a single reader thread calls read() whenever it wants the newest state.
+     */
+    template<int dim>
+    struct SnapshotChannel {
+        SnapshotFields fields;
+        int every;
+        TripleBuffer<Snapshot<dim>> buffer;
+
+        // See TripleBuffer::read()
+        auto read() -> const Snapshot<dim> * { return buffer.read(); }
+    };
+
+    /**
+     * Material math shared by MPMSimulation and BatchedMPMSimulation. T is a real for one particle, or a Lanes array
+     * with one value per simulation of a batch.
+     *
+     * Hardening factor e of the Lame parameters, mu = mu_0 e and lambda = lambda_0 e [http://mpm.graphics Eqn. 86],
+     * for snow, which hardens as its plastic volume ratio Jp shrinks.
+     */
+    template<typename T>
+    inline auto snow_hardening_factor(const real hardening, const T &Jp) -> T {
+        if constexpr (std::is_arithmetic_v<T>) {
+            return T(std::exp(hardening * (1.0 - Jp)));
+        } else {
+            return (hardening * (1.0 - Jp)).exp();
+        }
+    }
+
+    // Volume term lambda (J - 1) J of the fixed corotated P F^T [http://mpm.graphics Eqn. 52]
+    template<typename T>
+    inline auto corotated_volume_term(const T &lambda, const T &J) -> T {
+        return lambda * (J - 1) * J;
+    }
+
+    /**
+     * Pressure term of a liquid's P F^T = K (J - 1) J I. The bulk modulus K = lambda + 2 mu / dim is what the fixed
+     * corotated model resists a uniform compression with, so liquids keep the stiffness their E and nu give.
+     */
+    template<int dim, typename T>
+    inline auto liquid_pressure(const T &mu, const T &lambda, const T &J) -> T {
+        return (lambda + 2 * mu / dim) * (J - 1) * J;
+    }
+
+    // Largest grid velocity component kept by the grid update, so no particle crosses more than 0.9 cells per step
+    inline auto grid_velocity_limit(const real spacing, const real dt) -> real { return spacing * 0.9 / dt; }
+
+    /**
+     * Liquids only track the volume ratio J, advected to first order in dt by the velocity divergence tr(C).
+     */
+    template<int dim>
+    inline auto update_volume(const Matrix<real, dim> &C, const real dt, real &J) -> void {
+        J *= 1 + dt * C.trace();
+    }
+
+    /**
+     * Writes the advected deformation gradient _F back into F, applying the plasticity model of the material
+     * (which also updates Jp for snow). Liquids are meant to go through update_volume() instead, given an _F
+     * this keeps F and scales J by its determinant. For snow, R receives the rotation of the new F from the same
+     * SVD, the other models leave it alone.
+     */
+    template<int dim>
+    inline auto update_deformation(const MaterialModel model, Matrix<real, dim> _F, Matrix<real, dim> &F, real &Jp,
+                                   Matrix<real, dim> &R) -> void {
+        if (model == MaterialModel::kLiquid) {
+            Jp *= _F.determinant();
+        } else if (model == MaterialModel::kJelly) {
+            // MLS-MPM F-update for non-compressive elastic materials
+            F = _F;
+        } else {
+            Matrix<real, dim> U, sig, V;
+            nclr_svd(_F, U, sig, V);
+
+            if (model == MaterialModel::kSnow) {
+                // Plasticity operation on sigma
+#pragma unroll
+                for (int dd = 0; dd < dim; ++dd) {
+                    sig(dd, dd) = std::clamp(sig(dd, dd), real(1.0 - 2.5e-2), real(1.0 + 4.5e-3));
+                }
+
+                const auto old_J = _F.determinant();
+                _F = U * sig * V.transpose();
+                Jp = std::clamp(Jp * old_J / _F.determinant(), real(0.6), real(20.0));
+                F = _F;
+
+                // The clamped singular values are positive, so U V^T is the polar rotation of the new F
+                R = U * V.transpose();
+            }
+        }
+    }
+
+    template<int dim>
+    inline auto update_deformation(const MaterialModel model, Matrix<real, dim> _F, Matrix<real, dim> &F, real &Jp)
+            -> void {
+        Matrix<real, dim> R;
+        update_deformation<dim>(model, _F, F, Jp, R);
+    }
+
     template<int dim>
     class MPMSimulation {
     public:
         constexpr static int kBoundary = 3;
+
+        // Cells per side of a sleep block (see SleepSettings)
+        constexpr static int kSleepBlock = 4;
+
+        // Nodes in a particle's quadratic stencil
+        constexpr static int kStencil = dim == 2 ? 9 : 27;
+
+        // Particles per batch of the g2p() gather, one SIMD lane each
+        constexpr static int kGatherLanes = 8;
+
+        // Cells per side of a refinement block (see RefineSettings), the same blocks as for sleeping
+        constexpr static int kRefineBlock = kSleepBlock;
+
+        // Fine nodes per side and in total owned by a refined block
+        constexpr static int kFineSide = 2 * kRefineBlock;
+        constexpr static int kFineNodes = dim == 2 ? kFineSide * kFineSide : kFineSide * kFineSide * kFineSide;
+
         constexpr static nclr::real kSnowHardening = 10.0;
         constexpr static nclr::real kJellyHardening = 0.3;
         constexpr static nclr::real kLiquidHardening = 1.0;
@@ -71,21 +353,282 @@ namespace nclr {
         const real mu_0;
         const real lambda_0;
 
+        /**
+         * The grid spans [0, extent] along every axis with res cells per axis, so particle positions are expected
+         * to lie in that box (minus the kBoundary sticky layer).
+         */
         MPMSimulation(std::vector<Particle<dim>> particles, const MaterialModel model, int res = 64, real dt = 1e-4,
-                      real E = 1e4, real nu = 0.2, real gravity = -100)
-            : particles_(std::move(particles)), material_model_(model), res_(res), dt_(dt), dx_(1.0 / res),
+                      real E = 1e4, real nu = 0.2, real gravity = -100, real extent = 1.0)
+            : particles_(std::move(particles)), material_model_(model), res_(res), dt_(dt), dx_(extent / res),
               inv_dx_(1 / dx_), E_(E), nu_(nu), gravity_(gravity), mu_0(E / (2 * (1 + nu))),
-              lambda_0(E * nu / ((1 + nu) * (1 - 2 * nu))) {}
+              lambda_0(E * nu / ((1 + nu) * (1 - 2 * nu))) {
+            add_deformations(0);
+            handle_escapes(0);
+        }
 
         auto advance() -> void {
+            if (!pool_) { pool_ = std::make_unique<WorkerPool>(threads_); }
+            emit();
+            if (refine_.enabled && (steps_ % refine_.every == 0 || refine_dirty_)) { update_refinement(); }
             p2g();
             grid_op();
             g2p();
+            if (!sinks_.empty()) {
+                remove_particles([this](const Particle<dim> &p) -> bool {
+                    return std::any_of(sinks_.begin(), sinks_.end(),
+                                       [&p](const Sink<dim> &sink) -> bool { return sink.contains(p.x); });
+                });
+            }
+            if (adaptive_.enabled && (steps_ + 1) % adaptive_.every == 0) { adapt(); }
+
+            ++steps_;
+            for (const auto &channel : channels_) {
+                if (steps_ % channel->every == 0) { publish(*channel); }
+            }
+        }
+
+        /**
+         * Runs n_steps steps in one call, on the worker threads set by set_threads() for the whole run. Before every
+         * step whose index (counted from 0 in this call) is a multiple of callback_every, and once more after the
+         * last step, callback(step, sim) gets read-only access to the current state, so step 0 sees the state on
+         * entry and step n_steps the final one. The callback runs on the calling thread between steps, so the state
+         * is consistent while it runs, but it is the live simulation: anything kept past the call has to be copied
+         * (or read through a snapshot channel). A callback_every of 0 never calls back.
+         */
+        template<typename Callback>
+        auto advance(int n_steps, int callback_every, Callback &&callback) -> void {
+            for (int step = 0; step < n_steps; ++step) {
+                if (callback_every > 0 && step % callback_every == 0) { callback(step, std::as_const(*this)); }
+                advance();
+            }
+            if (callback_every > 0) { callback(n_steps, std::as_const(*this)); }
+        }
+
+        auto add_collider(const Collider<dim> &collider) -> void { colliders_.push_back(collider); }
+
+        /**
+         * Opens a snapshot feed for a reader on another thread. The current state is published right away, and
+         * after that advance() publishes every `every` steps. particles() is only safe to read on the thread that
+         * calls advance(), so concurrent readers should go through a channel instead.
+         */
+        auto add_snapshot_channel(SnapshotFields fields = {}, int every = 1) -> std::shared_ptr<SnapshotChannel<dim>> {
+            auto channel = std::make_shared<SnapshotChannel<dim>>();
+            channel->fields = fields;
+            channel->every = std::max(every, 1);
+            publish(*channel);
+            channels_.push_back(channel);
+            return channel;
+        }
+
+        // Steps run since construction
+        auto steps() const -> std::size_t { return steps_; }
+        auto add_source(const Source<dim> &source) -> void { sources_.push_back(source); }
+        auto add_sink(const Sink<dim> &sink) -> void { sinks_.push_back(sink); }
+
+        /**
+         * Threads for the parallel passes of a step (compaction, the escape pass, snapshots, adaptivity and the fine
+         * grid), 0 picks one per core. They are started by the next advance() and stay parked between passes and
+         * steps, so configuring a new simulation never starts threads it doesn't step with.
+         */
+        auto set_threads(int threads) -> void {
+            threads_ = threads;
+            pool_.reset();
+        }
+
+        // The policy also applies right away to the current particles, and to particles as they are added
+        auto set_escape_policy(EscapePolicy policy) -> void {
+            escape_policy_ = policy;
+            handle_escapes(0);
+        }
+
+        // Enables or disables sleeping, every block starts awake
+        auto set_sleeping(const SleepSettings &settings) -> void {
+            sleep_ = settings;
+            sleep_blocks_ = (res_ + kSleepBlock - 1) / kSleepBlock;
+            std::size_t blocks = 1;
+            for (int dd = 0; dd < dim; ++dd) { blocks *= sleep_blocks_; }
+            asleep_.assign(settings.enabled ? blocks : 0, 0);
+            calm_steps_.assign(asleep_.size(), 0);
+            restless_.assign(asleep_.size(), 0);
+            occupied_.assign(asleep_.size(), 0);
+            woken_.assign(asleep_.size(), 0);
+            sleeping_mass_.clear();
+            sleeping_mass_dirty_ = true;
+            sleeping_ = 0;
+        }
+
+        // Particles in sleeping blocks after the last step
+        auto sleeping_particles() const -> std::size_t { return sleeping_; }
+
+        /**
+         * Enables or disables adaptive resolution. The mean mass of the current particles becomes the reference
+         * mass (1 without particles). Splitting and merging change particle masses, which NCLR_UNIFORM_MASS makes
+         * a shared constant, so enabling it in such a build throws.
+         */
+        auto set_adaptive(const AdaptiveSettings &settings) -> void {
+            adaptive_ = settings;
+            adaptive_.every = std::max(settings.every, 1);
+            reference_mass_ = 1;
+#ifdef NCLR_UNIFORM_MASS
+            if (settings.enabled) {
+                throw std::runtime_error("adaptive resolution needs per-particle mass, which NCLR_UNIFORM_MASS "
+                                         "builds do not store");
+            }
+#else
+            if (!particles_.empty()) {
+                real total = 0;
+                for (const auto &p : particles_) { total += p.mass; }
+                reference_mass_ = total / particles_.size();
+            }
+#endif
+        }
+
+        // Enables or disables the two-level grid, the refined set is built at the next step
+        auto set_refinement(const RefineSettings &settings) -> void {
+            refine_ = settings;
+            refine_.every = std::max(settings.every, 1);
+            refine_blocks_ = (res_ + kRefineBlock - 1) / kRefineBlock;
+            std::size_t blocks = 1;
+            for (int dd = 0; dd < dim; ++dd) { blocks *= refine_blocks_; }
+            refined_.assign(settings.enabled ? blocks : 0, 0);
+            fine_slot_.assign(refined_.size(), -1);
+            fine_blocks_.clear();
+            fine_cells_.clear();
+            refine_dirty_ = true;
+        }
+
+        // Blocks with a fine grid after the last step
+        auto refined_blocks() const -> std::size_t {
+            return std::count(refined_.begin(), refined_.end(), uint8_t(kRefined));
+        }
+
+        // Whether a particle at x gathers from the fine grid, for the refined set of the last step
+        auto refined_at(const Vector<real, dim> &x) const -> bool {
+            return refine_.enabled && !refined_.empty() && refinement(x) == kRefined;
+        }
+
+        /**
+         * Share of a particle at x that the fine grid carries, for the refined set of the last step: 1 in refined
+         * blocks, 0 in coarse ones, and in the ring falling linearly to 0 over the first kRefineBlock - 1 cells
+         * away from the nearest refined block. The rest goes to the coarse grid.
+         */
+        auto fine_share(const Vector<real, dim> &x) const -> real {
+            if (!refine_.enabled || refined_.empty()) { return 0; }
+            const uint8_t level = refinement(x);
+            if (level != kRing) { return level == kRefined ? 1 : 0; }
+
+            // Distance along the farthest axis, in cells, from x to the box of the nearest refined block
+            const Vector<real, dim> cell = x * inv_dx_;
+            real distance = kRefineBlock;
+            for_each_block_around(block_at(x), [&](int neighbor) {
+                if (refined_[neighbor] != kRefined) { return; }
+                real gap = 0;
+                for (int dd = dim - 1, rest = neighbor; dd >= 0; --dd, rest /= refine_blocks_) {
+                    const real lo = real(rest % refine_blocks_ * kRefineBlock), hi = lo + kRefineBlock;
+                    gap = std::max({gap, lo - cell(dd), cell(dd) - hi});
+                }
+                distance = std::min(distance, gap);
+            });
+            return std::max(1 - distance / (kRefineBlock - 1), real(0));
+        }
+
+        // Splits and merges done by adaptive resolution so far
+        auto split_particles() const -> std::size_t { return splits_; }
+        auto merged_particles() const -> std::size_t { return merges_; }
+
+        // Particles clamped or deleted so far, or with kCount the number currently outside the domain
+        auto escaped_particles() const -> std::size_t { return escaped_; }
+
+        /**
+         * Appends particles at the end of the list (amortized O(1) each, the storage grows geometrically). They start
+         * undeformed, and particles outside the domain are handled by the escape policy on the way in. This
+         * invalidates references returned by particles() and deformations().
+         */
+        auto add_particles(const std::vector<Particle<dim>> &particles) -> void {
+            const std::size_t begin = particles_.size();
+            particles_.insert(particles_.end(), particles.begin(), particles.end());
+            add_deformations(begin);
+            handle_escapes(begin);
+            if (sleep_.enabled) {
+                for (std::size_t pp = begin; pp < particles_.size(); ++pp) { wake_at(particles_[pp].x); }
+            }
+        }
+
+        /**
+         * Removes every particle for which remove(p) is true and returns how many were removed. The compaction is
+         * stable, so a list sorted by cell stays sorted: blocks count their survivors in parallel, an exclusive
+         * scan turns the counts into output offsets and the blocks then copy their survivors in parallel.
+         */
+        template<typename Predicate>
+        auto remove_particles(Predicate &&remove) -> std::size_t {
+            constexpr std::size_t kBlockSize = 4096;
+
+            const std::size_t blocks = (particles_.size() + kBlockSize - 1) / kBlockSize;
+            std::vector<uint8_t> keep(particles_.size());
+            std::vector<std::size_t> offsets(blocks + 1, 0);
+            parallel_blocks(particles_.size(), kBlockSize, pool(), [&](std::size_t begin, std::size_t end) {
+                std::size_t survivors = 0;
+                for (std::size_t ii = begin; ii < end; ++ii) {
+                    keep[ii] = !remove(particles_[ii]);
+                    survivors += keep[ii];
+                }
+                offsets[begin / kBlockSize + 1] = survivors;
+            });
+            for (std::size_t bb = 0; bb < blocks; ++bb) { offsets[bb + 1] += offsets[bb]; }
+
+            const std::size_t removed = particles_.size() - offsets.back();
+            if (removed == 0) { return 0; }
+
+            std::vector<Particle<dim>> compacted(offsets.back(), Particle<dim>(constvec<dim>(0), 0));
+            parallel_blocks(particles_.size(), kBlockSize, pool(), [&](std::size_t begin, std::size_t end) {
+                std::size_t out = offsets[begin / kBlockSize];
+                for (std::size_t ii = begin; ii < end; ++ii) {
+                    if (keep[ii]) { compacted[out++] = particles_[ii]; }
+                }
+            });
+            // Deformations and rotations follow their particles
+            const auto compact = [&](std::vector<Matrix<real, dim>> &values) -> void {
+                std::vector<Matrix<real, dim>> compacted_values(offsets.back());
+                parallel_blocks(keep.size(), kBlockSize, pool(), [&](std::size_t begin, std::size_t end) {
+                    std::size_t out = offsets[begin / kBlockSize];
+                    for (std::size_t ii = begin; ii < end; ++ii) {
+                        if (keep[ii]) { compacted_values[out++] = values[ii]; }
+                    }
+                });
+                values = std::move(compacted_values);
+            };
+            if (!deformations_.empty()) {
+                compact(deformations_);
+                compact(rotations_);
+            }
+
+            particles_ = std::move(compacted);
+            sleeping_mass_dirty_ = true;
+            return removed;
         }
 
         auto particles() const -> const std::vector<Particle<dim>> & { return particles_; }
+
+        // Deformation gradient F of each particle, in particle order, for snow and jelly (empty for liquids)
+        auto deformations() const -> const std::vector<Matrix<real, dim>> & { return deformations_; }
+
+        // Rotation part of each particle's F, in particle order, for snow and jelly (empty for liquids)
+        auto rotations() const -> const std::vector<Matrix<real, dim>> & { return rotations_; }
+
+        // Coarse grid of the last step, with the two-level grid it only holds the coarse share (see fine_share())
         auto grid() const -> const std::vector<Cell<dim>> & { return cells_; }
 
+        auto res() const -> int { return res_; }
+        auto dt() const -> real { return dt_; }
+        auto dx() const -> real { return dx_; }
+
+        // Number of grid nodes, (res + 1)^dim
+        auto grid_size() const -> int {
+            int size = 1;
+            for (int dd = 0; dd < dim; ++dd) { size *= res_ + 1; }
+            return size;
+        }
+
     private:
         const MaterialModel material_model_;
 
@@ -100,17 +643,108 @@ namespace nclr {
 
         std::vector<Cell<dim>> cells_;
         std::vector<Particle<dim>> particles_;
+        std::vector<Collider<dim>> colliders_;
+        std::vector<Source<dim>> sources_;
+        std::vector<Sink<dim>> sinks_;
+
+        int threads_ = 0;
+        std::unique_ptr<WorkerPool> pool_;
+
+        // Runs the passes of the constructor and setters on the calling thread until the first advance()
+        mutable WorkerPool serial_{1};
+
+        inline auto pool() const -> WorkerPool & { return pool_ ? *pool_ : serial_; }
+
+        std::size_t steps_ = 0;
+        std::vector<std::shared_ptr<SnapshotChannel<dim>>> channels_;
+
+        // Copies the selected fields into the channel's back slot (reusing its storage) and publishes it
+        inline auto publish(SnapshotChannel<dim> &channel) -> void {
+            constexpr std::size_t kBlockSize = 4096;
+
+            auto &snapshot = channel.buffer.back();
+            const auto &fields = channel.fields;
+            const std::size_t n = particles_.size();
+            snapshot.step = steps_;
+            snapshot.x.resize(n);
+            snapshot.v.resize(fields.velocity ? n : 0);
+            snapshot.F.resize(fields.deformation ? n : 0);
+            snapshot.Jp.resize(fields.Jp ? n : 0);
+            snapshot.c.resize(fields.color ? n : 0);
+
+            // Liquids don't track F, their snapshots report it as the identity
+            const bool liquid = material_model_ == MaterialModel::kLiquid;
+            const Matrix<real, dim> identity = diag<dim>(1);
+
+            parallel_blocks(n, kBlockSize, pool(), [&](std::size_t begin, std::size_t end) {
+                for (std::size_t pp = begin; pp < end; ++pp) {
+                    const auto &p = particles_[pp];
+                    snapshot.x[pp] = p.x;
+                    if (fields.velocity) { snapshot.v[pp] = p.v; }
+                    if (fields.deformation) { snapshot.F[pp] = liquid ? identity : deformations_[pp]; }
+                    if (fields.Jp) { snapshot.Jp[pp] = p.Jp; }
+                    if (fields.color) { snapshot.c[pp] = p.c; }
+                }
+            });
+            channel.buffer.publish();
+        }
 
-        inline auto p2g() -> void {
-            if constexpr (dim == 3) {
-                cells_ = std::vector<Cell<dim>>((res_ + 1) * (res_ + 1) * (res_ + 1), Cell<dim>());
-            } else {
-                cells_ = std::vector<Cell<dim>>((res_ + 1) * (res_ + 1), Cell<dim>());
+        EscapePolicy escape_policy_ = EscapePolicy::kClamp;
+        std::size_t escaped_ = 0;
+
+        /**
+         * Deformation gradient of every particle for snow and jelly. Liquids only track their volume ratio in Jp, so
+         * they keep it empty and carry no dim x dim F through p2g() and g2p().
+         */
+        std::vector<Matrix<real, dim>> deformations_;
+
+        /**
+         * Rotation part (polar decomposition) of every particle's F, kept by g2p() for snow and jelly so that p2g()
+         * needs no SVD. Empty for liquids like deformations_.
+         */
+        std::vector<Matrix<real, dim>> rotations_;
+
+        // Particles from begin on start undeformed, F and its rotation are the identity
+        inline auto add_deformations(const std::size_t begin) -> void {
+            if (material_model_ == MaterialModel::kLiquid) { return; }
+            deformations_.resize(begin);
+            deformations_.resize(particles_.size(), diag<dim>(1));
+            rotations_.resize(begin);
+            rotations_.resize(particles_.size(), diag<dim>(1));
+        }
+
+        inline auto emit() -> void {
+            const std::size_t begin = particles_.size();
+            for (const auto &source : sources_) {
+                for (int ii = 0; ii < source.per_step; ++ii) {
+                    const Vector<real, dim> offset = (randvec<dim>() * 2.0 - constvec<dim>(1)).cwiseProduct(
+                            source.half_extent);
+                    particles_.emplace_back(source.center + offset, source.c, source.velocity);
+                }
             }
+            if (particles_.size() == begin) { return; }
+
+            // Emitted particles start undeformed
+            add_deformations(begin);
+
+            // A source that reaches past the domain would otherwise hand p2g() particles off the grid
+            handle_escapes(begin);
+            if (sleep_.enabled) {
+                for (std::size_t pp = begin; pp < particles_.size(); ++pp) { wake_at(particles_[pp].x); }
+            }
+        }
+
+        inline auto p2g() -> void {
+            // Reuses the grid's storage, so grid() (and views of it) stay valid across steps
+            cells_.assign(grid_size(), Cell<dim>());
+            if (refine_.enabled) { fine_cells_.assign(fine_cells_.size(), Cell<dim>()); }
 
 #pragma omp parallel for
-            for (auto pp = 0; pp < particles_.size(); ++pp) {
+            for (std::size_t pp = 0; pp < particles_.size(); ++pp) {
                 auto &p = particles_.at(pp);
+                if (escape_policy_ == EscapePolicy::kCount && !in_domain(p.x)) { continue; }
+                if (sleep_.enabled && is_asleep(p.x)) { continue; }
+
                 // element-wise floor
                 const Vector<int, dim> base_coord = (p.x * inv_dx_ - constvec<dim>(0.5)).template cast<int>();
 
@@ -126,135 +760,785 @@ namespace nclr {
                         constvec<dim>(0.75) - Eigen::square((fx - constvec<dim>(1.0)).array()).matrix(),
                         constvec<dim>(0.5).cwiseProduct(Eigen::square((fx - constvec<dim>(0.5)).array()).matrix())};
 
-                const Matrix<real, dim> affine = first_piola_kirchoff_stress(p);
+                const Matrix<real, dim> affine = first_piola_kirchoff_stress(pp);
+
+                // The two levels split the particle between them, g2p() gathers with the same shares
+                const real fine = fine_share(p.x);
+                const real coarse = 1 - fine;
+
+                // Particle momentum is the same for every node in the stencil
+                const Vector<real, dim> momentum = p.v * p.mass;
 
                 // P2G
                 for (int ii = 0; ii < 3; ++ii) {
                     for (int jj = 0; jj < 3; ++jj) {
                         if constexpr (dim == 3) {
+                            for (int kk = 0; kk < 3; ++kk) {
 #ifdef NCLR_DEBUG
-                            assert(!oob(base_coord, Vector<real, dim>(ii, jj, kk)));
+                                assert(!oob(base_coord, Vector<int, dim>(ii, jj, kk)));
 #endif
-                            for (int kk = 0; kk < 3; ++kk) {
                                 const Vector<real, dim> dpos = (Vector<real, dim>(ii, jj, kk) - fx) * dx_;
                                 const auto weight = w[ii][0] * w[jj][1] * w[kk][2];
                                 const auto index = ((base_coord.x() + ii) * (res_ + 1) * (res_ + 1)) +
                                                    ((base_coord.y() + jj) * (res_ + 1)) + (base_coord.z() + kk);
-                                compute_fused_momentum(index, weight, dpos, affine, p);
+                                compute_fused_momentum(index, coarse * weight, dpos, affine, momentum, p.mass);
                             }
 
                         } else {
 #ifdef NCLR_DEBUG
-                            assert(!oob(base_coord, Vector<real, dim>(ii, jj)));
+                            assert(!oob(base_coord, Vector<int, dim>(ii, jj)));
 #endif
                             const Vector<real, dim> dpos = (Vector<real, dim>(ii, jj) - fx) * dx_;
                             const auto weight = w[ii][0] * w[jj][1];
                             const auto index = ((base_coord.x() + ii) * (res_ + 1)) + (base_coord.y() + jj);
-                            compute_fused_momentum(index, weight, dpos, affine, p);
+                            compute_fused_momentum(index, coarse * weight, dpos, affine, momentum, p.mass);
                         }
                     }
                 }
+
+                if (fine > 0) { scatter_fine(p, affine, fine); }
             }
+
+            if (sleep_.enabled) { add_sleeping_mass(); }
         }
 
         inline auto compute_fused_momentum(const int index, const float weight, const Vector<real, dim> &dpos,
-                                           const Matrix<real, dim> &affine, const Particle<dim> &particle) -> void {
-            const Vector<real, dim> mass_x_velocity = particle.v * particle.mass;
-            cells_.at(index).velocity += (weight * (mass_x_velocity + (affine * dpos)));
-            cells_.at(index).mass += weight * particle.mass;
+                                           const Matrix<real, dim> &affine, const Vector<real, dim> &momentum,
+                                           const real mass) -> void {
+            cells_.at(index).velocity += (weight * (momentum + (affine * dpos)));
+            cells_.at(index).mass += weight * mass;
         }
 
         inline auto g2p() -> void {
 #pragma omp parallel for
-            for (auto pp = 0; pp < particles_.size(); ++pp) {
-                auto &p = particles_.at(pp);
-                // element-wise floor
-                const Vector<int, dim> base_coord = (p.x * inv_dx_ - constvec<dim>(0.5)).template cast<int>();
-#ifdef NCLR_DEBUG
-                assert(!oob(base_coord));
-#endif
+            for (std::size_t begin = 0; begin < particles_.size(); begin += kGatherLanes) {
+                const int lanes = int(std::min<std::size_t>(kGatherLanes, particles_.size() - begin));
+
+                // Refined particles gather one by one from the fine grid, the rest of the batch together
+                std::array<uint8_t, kGatherLanes> moving{}, coarse{};
+                std::array<real, kGatherLanes> fine{};
+                for (int ll = 0; ll < lanes; ++ll) {
+                    auto &p = particles_[begin + ll];
+                    moving[ll] = !(escape_policy_ == EscapePolicy::kCount && !in_domain(p.x)) &&
+                                 !(sleep_.enabled && is_asleep(p.x));
+                    if (!moving[ll]) { continue; }
+                    fine[ll] = fine_share(p.x);
+                    if (fine[ll] == 1) {
+                        gather_fine(p);
+                    } else {
+                        coarse[ll] = 1;
+                    }
+                }
+                gather(begin, coarse);
+
+                // Ring particles blend both levels with the shares they scattered with, which conserves momentum
+                for (int ll = 0; ll < lanes; ++ll) {
+                    if (!coarse[ll] || fine[ll] == 0) { continue; }
+                    auto &p = particles_[begin + ll];
+                    const Vector<real, dim> v = p.v;
+                    const Matrix<real, dim> C = p.C;
+                    gather_fine(p);
+                    p.v = fine[ll] * p.v + (1 - fine[ll]) * v;
+                    p.C = fine[ll] * p.C + (1 - fine[ll]) * C;
+                }
 
-                const Vector<real, dim> fx = p.x * inv_dx_ - base_coord.template cast<real>();
+                for (int ll = 0; ll < lanes; ++ll) {
+                    if (!moving[ll]) { continue; }
+                    const std::size_t pp = begin + ll;
+                    auto &p = particles_[pp];
 
-                // Quadratic kernels [http://mpm.graphics Eqn. 123, with x=fx, fx-1,fx-2]
-                std::vector<Vector<real, dim>> w{
-                        constvec<dim>(0.5).cwiseProduct(Eigen::square((constvec<dim>(1.5) - fx).array()).matrix()),
-                        constvec<dim>(0.75) - Eigen::square((fx - constvec<dim>(1.0)).array()).matrix(),
-                        constvec<dim>(0.5).cwiseProduct(Eigen::square((fx - constvec<dim>(0.5)).array()).matrix())};
+                    // Advection
+                    p.x += dt_ * p.v;
+                    if (material_model_ == MaterialModel::kLiquid) {
+                        if (sleep_.enabled) { note_rest(p, dt_ * p.C); }
+                        update_volume<dim>(p.C, dt_, p.Jp);
+                    } else {
+                        auto &F = deformations_[pp];
+                        const Matrix<real, dim> _F = (diag<dim>(1) + dt_ * p.C) * F;
+                        if (sleep_.enabled) { note_rest(p, _F - F); }
+                        update_deformation<dim>(material_model_, _F, F, p.Jp, rotations_[pp]);
 
-                p.C = constmat<dim>(0);
-                p.v = constvec<dim>(0);
+                        // Jelly's F update has no SVD, its rotation is refined from the last step's instead
+                        if (material_model_ == MaterialModel::kJelly) { nclr_rotation<dim>(F, rotations_[pp]); }
+                    }
+                }
+            }
 
-                for (int ii = 0; ii < 3; ++ii) {
-                    for (int jj = 0; jj < 3; ++jj) {
-                        if constexpr (dim == 3) {
-                            for (int kk = 0; kk < 3; ++kk) {
+            handle_escapes();
+            if (sleep_.enabled) { update_sleep(); }
+        }
+
+        /**
+         * Gathers v and C from the coarse grid for the kGatherLanes particles starting at begin, one lane per
+         * particle, for the lanes flagged in coarse. The kernel weights and the APIC sums run across the lanes; only
+         * the grid velocities are loaded lane by lane. Unflagged lanes gather around the middle of the grid and are
+         * not written back. The sums visit the nodes in the same order as a per-particle g2p() gather would (last
+         * axis fastest), tests/test_gather.cpp compares the two.
+         */
+        inline auto gather(std::size_t begin, const std::array<uint8_t, kGatherLanes> &coarse) -> void {
+            LaneVector<dim, kGatherLanes> x = LaneVector<dim, kGatherLanes>::Constant(real(0.5) * res_ * dx_);
+            bool any = false;
+            for (int ll = 0; ll < kGatherLanes; ++ll) {
+                if (!coarse[ll]) { continue; }
+                x.row(ll) = particles_[begin + ll].x.transpose();
+                any = true;
+            }
+            if (!any) { return; }
+
+            // element-wise floor
+            const Eigen::Array<int, kGatherLanes, dim> base_coord = (x * inv_dx_ - real(0.5)).template cast<int>();
 #ifdef NCLR_DEBUG
-                                assert(!oob(base_coord, Vector<real, dim>(ii, jj, kk)));
+            for (int ll = 0; ll < kGatherLanes; ++ll) {
+                assert(!oob(base_coord.row(ll).transpose(), Vector<int, dim>::Constant(2)));
+            }
 #endif
-                                const Vector<real, dim> dpos = (Vector<real, dim>(ii, jj, kk) - fx);
+            const LaneVector<dim, kGatherLanes> fx = x * inv_dx_ - base_coord.template cast<real>();
+
+            // Quadratic kernels [http://mpm.graphics Eqn. 123, with x=fx, fx-1,fx-2]
+            const std::array<LaneVector<dim, kGatherLanes>, 3> w{real(0.5) * (real(1.5) - fx).square(),
+                                                                 real(0.75) - (fx - real(1.0)).square(),
+                                                                 real(0.5) * (fx - real(0.5)).square()};
+
+            LaneVector<dim, kGatherLanes> v = LaneVector<dim, kGatherLanes>::Zero();
+            LaneMatrix<dim, kGatherLanes> C = LaneMatrix<dim, kGatherLanes>::Zero();
+            LaneVector<dim, kGatherLanes> grid_v;
+            for (int nn = 0; nn < kStencil; ++nn) {
+                // Node offsets with the last axis fastest, like the nested loops
+                Vector<int, dim> offset;
+                for (int dd = dim - 1, rest = nn; dd >= 0; --dd, rest /= 3) { offset[dd] = rest % 3; }
+
+                Lanes<kGatherLanes> weight = w[offset[0]].col(0);
+                Eigen::Array<int, kGatherLanes, 1> index = base_coord.col(0) + offset[0];
+                for (int dd = 1; dd < dim; ++dd) {
+                    weight *= w[offset[dd]].col(dd);
+                    index = index * (res_ + 1) + base_coord.col(dd) + offset[dd];
+                }
+                for (int ll = 0; ll < kGatherLanes; ++ll) { grid_v.row(ll) = cells_[index[ll]].velocity.transpose(); }
 
-                                const auto index = ((base_coord.x() + ii) * (res_ + 1) * (res_ + 1)) +
-                                                   ((base_coord.y() + jj) * (res_ + 1)) + (base_coord.z() + kk);
-                                const Vector<real, dim> &grid_v = cells_.at(index).velocity;
-                                const auto weight = w[ii][0] * w[jj][1] * w[kk][2];
+                for (int rr = 0; rr < dim; ++rr) {
+                    const Lanes<kGatherLanes> momentum = weight * grid_v.col(rr);
+
+                    // Velocity
+                    v.col(rr) += momentum;
+
+                    // APIC C
+                    for (int cc = 0; cc < dim; ++cc) {
+                        C.col(rr + cc * dim) += (4 * inv_dx_ * momentum) * (real(offset[cc]) - fx.col(cc));
+                    }
+                }
+            }
+
+            for (int ll = 0; ll < kGatherLanes; ++ll) {
+                if (!coarse[ll]) { continue; }
+                auto &p = particles_[begin + ll];
+                p.v = v.row(ll).transpose();
+                for (int cc = 0; cc < dim; ++cc) {
+                    for (int rr = 0; rr < dim; ++rr) { p.C(rr, cc) = C(ll, rr + cc * dim); }
+                }
+            }
+        }
+
+        /**
+         * Finds the particles from `first` on whose stencil would leave the grid (including NaN positions) and
+         * applies the escape policy, so a stray particle never reaches cells_.at() in the next p2g(). g2p() runs it
+         * over every particle after advection, and the particles that are added or emitted go through it as they
+         * come in. It is one extra pass over the particles per step, split into blocks over the parked worker pool.
+         */
+        inline auto handle_escapes(const std::size_t first = 0) -> void {
+            constexpr std::size_t kBlockSize = 4096;
+
+            const real lo = domain_min(), hi = domain_max();
+            std::atomic<std::size_t> escaped = 0;
+            parallel_blocks(particles_.size() - first, kBlockSize, pool(), [&](std::size_t begin, std::size_t end) {
+                std::size_t block_escaped = 0;
+                for (std::size_t pp = first + begin; pp < first + end; ++pp) {
+                    auto &p = particles_[pp];
+                    if (in_domain(p.x)) { continue; }
+                    ++block_escaped;
+
+                    if (escape_policy_ == EscapePolicy::kClamp) {
+                        for (int dd = 0; dd < dim; ++dd) {
+                            if (p.x(dd) >= lo && p.x(dd) <= hi) { continue; }
+                            // A NaN coordinate lands on the lower face
+                            p.x(dd) = p.x(dd) > hi ? hi : lo;
+                            p.v(dd) = 0;
+                        }
+                    }
+                }
+                escaped += block_escaped;
+            });
+
+            // Skipped particles stay outside, so kCount reports how many are out right now
+            if (escape_policy_ == EscapePolicy::kCount) {
+                escaped_ = (first == 0 ? 0 : escaped_) + escaped;
+                return;
+            }
+
+            escaped_ += escaped;
+            if (escaped > 0 && escape_policy_ == EscapePolicy::kDelete) {
+                remove_particles([this](const Particle<dim> &p) -> bool { return !in_domain(p.x); });
+            }
+        }
+
+        // Positions whose quadratic stencil stays on the grid, [dx, (res - 1) dx] along every axis
+        inline auto domain_min() const -> real { return dx_; }
+        inline auto domain_max() const -> real { return (res_ - 1) * dx_; }
+
+        inline auto in_domain(const Vector<real, dim> &x) const -> bool {
+            // Written so that NaN compares as outside
+            return ((x.array() >= domain_min()) && (x.array() <= domain_max())).all();
+        }
+
+        AdaptiveSettings adaptive_;
+        real reference_mass_ = 1;
+        std::size_t splits_ = 0;
+        std::size_t merges_ = 0;
+
+        // Grid cell holding x, or -1 outside the domain
+        inline auto cell_index(const Vector<real, dim> &x) const -> int {
+            if (!in_domain(x)) { return -1; }
+            int cell = 0;
+            for (int dd = 0; dd < dim; ++dd) { cell = cell * res_ + std::min(int(x(dd) * inv_dx_), res_ - 1); }
+            return cell;
+        }
+
+        // Calls fn(neighbor) for the face neighbors of a cell (see cell_index()) inside the grid
+        template<typename Fn>
+        inline auto for_each_face(const int cell, Fn &&fn) const -> void {
+            int stride = 1;
+            for (int dd = dim - 1; dd >= 0; --dd) {
+                const int coord = (cell / stride) % res_;
+                if (coord > 0) { fn(cell - stride); }
+                if (coord < res_ - 1) { fn(cell + stride); }
+                stride *= res_;
+            }
+        }
+
+        // Flags the occupied cells next to an empty one, the walls don't count as empty
+        template<typename Occupied>
+        inline auto surface_cells(Occupied &&occupied) const -> std::vector<uint8_t> {
+            int cells = 1;
+            for (int dd = 0; dd < dim; ++dd) { cells *= res_; }
+            std::vector<uint8_t> surface(cells, 0);
+            parallel_for(cells, pool(), [&](int cell) {
+                if (!occupied(cell)) { return; }
+                for_each_face(cell, [&](int neighbor) {
+                    if (!occupied(neighbor)) { surface[cell] = 1; }
+                });
+            });
+            return surface;
+        }
 
-                                // Velocity
-                                p.v += weight * grid_v;
+        // Largest entry of the strain a particle picks up per step, the symmetric part of dt C
+        inline auto strain(const Particle<dim> &p) const -> real {
+            return dt_ * real(0.5) * (p.C + p.C.transpose()).cwiseAbs().maxCoeff();
+        }
+
+        // Halvings since the reference mass, negative for merged particles
+        inline auto level(const Particle<dim> &p) const -> int {
+            return int(std::lround(std::log2(reference_mass_ / p.mass)));
+        }
+
+        /**
+         * One adaptive resolution pass (see AdaptiveSettings). Particles are binned by cell and each cell decides
+         * its own splits and merges, so cells run in parallel. A merged-away particle is marked with zero mass and
+         * removed by the usual stable compaction, and the second halves of split particles go at the end.
+         */
+        inline auto adapt() -> void {
+#ifndef NCLR_UNIFORM_MASS
+            constexpr std::size_t kBlockSize = 4096;
+
+            int cells = 1;
+            for (int dd = 0; dd < dim; ++dd) { cells *= res_; }
+
+            // Counting sort of the particle indices by cell
+            std::vector<int> cell_of(particles_.size());
+            std::vector<int> offsets(cells + 1, 0);
+            parallel_blocks(particles_.size(), kBlockSize, pool(), [&](std::size_t begin, std::size_t end) {
+                for (std::size_t pp = begin; pp < end; ++pp) { cell_of[pp] = cell_index(particles_[pp].x); }
+            });
+            for (const int cell : cell_of) {
+                if (cell >= 0) { ++offsets[cell + 1]; }
+            }
+            for (int cc = 0; cc < cells; ++cc) { offsets[cc + 1] += offsets[cc]; }
+            std::vector<int> order(offsets.back());
+            {
+                std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+                for (std::size_t pp = 0; pp < cell_of.size(); ++pp) {
+                    if (cell_of[pp] >= 0) { order[fill[cell_of[pp]]++] = int(pp); }
+                }
+            }
 
-                                // APIC C
-                                p.C += 4 * inv_dx_ * (weight * grid_v) * dpos.transpose();
+            const auto occupied = [&offsets](int cell) -> bool { return offsets[cell + 1] > offsets[cell]; };
+            const std::vector<uint8_t> surface = surface_cells(occupied);
+
+            const real max_mass = reference_mass_ * std::pow(real(2), real(adaptive_.merge_levels)) * real(1.0001);
+
+            std::vector<uint8_t> split(particles_.size(), 0);
+            std::atomic<std::size_t> merged = 0;
+            parallel_blocks(cells, 256, pool(), [&](std::size_t begin, std::size_t end) {
+                std::size_t block_merged = 0;
+                std::vector<int> calm;
+                for (std::size_t cell = begin; cell < end; ++cell) {
+                    bool interior = occupied(int(cell)) && !surface[cell];
+                    if (interior) {
+                        for_each_face(int(cell), [&](int neighbor) {
+                            if (surface[neighbor]) { interior = false; }
+                        });
+                    }
+
+                    calm.clear();
+                    for (int oo = offsets[cell]; oo < offsets[cell + 1]; ++oo) {
+                        const int pp = order[oo];
+                        const auto &p = particles_[pp];
+                        if (sleep_.enabled && is_asleep(p.x)) { continue; }
+                        const real e = strain(p);
+                        if ((surface[cell] || e > adaptive_.split_strain) && level(p) < adaptive_.split_levels) {
+                            split[pp] = 1;
+                        } else if (interior && e < adaptive_.merge_strain) {
+                            calm.push_back(pp);
+                        }
+                    }
+
+                    // Pairs up calm particles of the same level and color
+                    for (std::size_t ii = 0; ii < calm.size(); ++ii) {
+                        auto &a = particles_[calm[ii]];
+                        if (a.mass == 0) { continue; }
+                        for (std::size_t jj = ii + 1; jj < calm.size(); ++jj) {
+                            auto &b = particles_[calm[jj]];
+                            if (b.mass == 0 || b.c != a.c || level(b) != level(a) || a.mass + b.mass > max_mass) {
+                                continue;
                             }
+                            merge(calm[ii], calm[jj]);
+                            ++block_merged;
+                            break;
+                        }
+                    }
+                }
+                merged += block_merged;
+            });
+
+            // Splitting stops at max_particles, the first particles in the list go first
+            const std::size_t survivors = particles_.size() - merged;
+            std::size_t budget = particles_.size();
+            if (adaptive_.max_particles > 0) {
+                budget = adaptive_.max_particles > survivors ? adaptive_.max_particles - survivors : 0;
+            }
+            std::vector<Particle<dim>> halves;
+            std::vector<Matrix<real, dim>> half_deformations, half_rotations;
+            for (std::size_t pp = 0; pp < particles_.size() && budget > 0; ++pp) {
+                if (!split[pp]) { continue; }
+                halves.push_back(split_off(pp));
+                if (!deformations_.empty()) {
+                    half_deformations.push_back(deformations_[pp]);
+                    half_rotations.push_back(rotations_[pp]);
+                }
+                --budget;
+            }
 
-                        } else {
-#ifdef NCLR_DEBUG
-                            assert(!oob(base_coord, Vector<real, dim>(ii, jj)));
+            if (merged > 0) {
+                remove_particles([](const Particle<dim> &p) -> bool { return p.mass == 0; });
+            }
+            particles_.insert(particles_.end(), halves.begin(), halves.end());
+            deformations_.insert(deformations_.end(), half_deformations.begin(), half_deformations.end());
+            rotations_.insert(rotations_.end(), half_rotations.begin(), half_rotations.end());
+            if (sleep_.enabled) {
+                for (const auto &p : halves) { wake_at(p.x); }
+            }
+            splits_ += halves.size();
+            merges_ += merged;
 #endif
-                            const Vector<real, dim> dpos = (Vector<real, dim>(ii, jj) - fx);
+        }
 
-                            const auto index = ((base_coord.x() + ii) * (res_ + 1)) + (base_coord.y() + jj);
-                            const Vector<real, dim> &grid_v = cells_.at(index).velocity;
-                            const auto weight = w[ii][0] * w[jj][1];
+        /**
+         * Halves particle pp in place and returns the other half. The two sit a quarter of the parent's extent
+         * either side of it along one material axis (mapped by F, so a grid axis for liquids), the axis cycling with
+         * the level so that repeated splits refine like a regular sampling. Both keep v, C, Jp and, for snow and
+         * jelly, F (the caller copies it for the new half), so mass and momentum are unchanged. Next to a wall the
+         * offset shrinks until both halves stay in the domain, which keeps their center of mass on the parent instead
+         * of handing a half to the escape policy.
+         */
+        inline auto split_off(const std::size_t pp) -> Particle<dim> {
+            auto &p = particles_[pp];
+#ifndef NCLR_UNIFORM_MASS
+            const int l = level(p);
+            const int axis = ((l % dim) + dim) % dim;
+            const real extent = adaptive_.spacing * dx_ * std::pow(real(2), -std::floor(real(l) / dim));
+            Vector<real, dim> offset = constvec<dim>(0);
+            offset(axis) = extent / 4;
+            if (!deformations_.empty()) { offset = deformations_[pp] * offset; }
+
+            real scale = 1;
+            for (int dd = 0; dd < dim; ++dd) {
+                const real room = std::max(std::min(p.x(dd) - domain_min(), domain_max() - p.x(dd)), real(0));
+                if (std::abs(offset(dd)) > room) { scale = std::min(scale, room / std::abs(offset(dd))); }
+            }
+            offset *= scale;
+
+            p.mass /= 2;
+            p.volume /= 2;
+            Particle<dim> half = p;
+            p.x -= offset;
+            half.x += offset;
+            return half;
+#else
+            return p;
+#endif
+        }
 
-                            // Velocity
-                            p.v += weight * grid_v;
+        /**
+         * Merges particle ib into particle ia at their center of mass and marks ib for removal with zero mass. The
+         * velocity, C, F and Jp of ia become mass weighted averages of the two, which keeps the total mass, momentum
+         * and mass weighted C. Liquids skip F, which they don't use.
+         */
+        inline auto merge(const std::size_t ia, const std::size_t ib) -> void {
+#ifndef NCLR_UNIFORM_MASS
+            auto &a = particles_[ia];
+            auto &b = particles_[ib];
+            const real mass = a.mass + b.mass;
+            const real wa = a.mass / mass, wb = b.mass / mass;
+            a.x = wa * a.x + wb * b.x;
+            a.v = wa * a.v + wb * b.v;
+            a.C = wa * a.C + wb * b.C;
+            if (!deformations_.empty()) {
+                deformations_[ia] = wa * deformations_[ia] + wb * deformations_[ib];
+                Matrix<real, dim> stretch;
+                nclr_polar(deformations_[ia], rotations_[ia], stretch);
+            }
+            a.Jp = wa * a.Jp + wb * b.Jp;
+            a.mass = mass;
+            a.volume += b.volume;
+            b.mass = 0;
+#endif
+        }
+
+        // States of a refinement block: no fine grid, fine nodes only (the ring around refined blocks), refined
+        constexpr static uint8_t kCoarse = 0;
+        constexpr static uint8_t kRing = 1;
+        constexpr static uint8_t kRefined = 2;
+
+        RefineSettings refine_;
+        int refine_blocks_ = 0;
+        std::vector<uint8_t> refined_;
+        bool refine_dirty_ = true;
+
+        // Fine nodes are stored per block, fine_slot_ maps a block to its slot in fine_cells_ (or -1)
+        std::vector<int> fine_slot_;
+        std::vector<int> fine_blocks_;
+        std::vector<Cell<dim>> fine_cells_;
 
-                            // APIC C
-                            p.C += 4 * inv_dx_ * (weight * grid_v) * dpos.transpose();
+        inline auto refinement(const Vector<real, dim> &x) const -> uint8_t {
+            return in_domain(x) ? refined_[block_at(x)] : kCoarse;
+        }
+
+        // Refinement block holding a position in the domain
+        inline auto block_at(const Vector<real, dim> &x) const -> int {
+            int block = 0;
+            for (int dd = 0; dd < dim; ++dd) {
+                block = block * refine_blocks_ + std::min(int(x(dd) * inv_dx_) / kRefineBlock, refine_blocks_ - 1);
+            }
+            return block;
+        }
+
+        /**
+         * Calls fn(index, weight, offset) for the nodes of a particle's quadratic stencil on the fine grid, index
+         * is into fine_cells_ or -1 for nodes whose block has no fine grid, offset is the node's stencil position
+         * minus fx in half cells. The stencil of a particle in the domain always lies inside the block grid, so
+         * only the slots need checking.
+         */
+        template<typename Fn>
+        inline auto for_each_fine_node(const Vector<real, dim> &x, Fn &&fn) const -> void {
+            const real inv_dx = 2 * inv_dx_;
+            const Vector<int, dim> base_coord = (x * inv_dx - constvec<dim>(0.5)).template cast<int>();
+            const Vector<real, dim> fx = x * inv_dx - base_coord.template cast<real>();
+            const std::array<Vector<real, dim>, 3> w{
+                    constvec<dim>(0.5).cwiseProduct(Eigen::square((constvec<dim>(1.5) - fx).array()).matrix()),
+                    constvec<dim>(0.75) - Eigen::square((fx - constvec<dim>(1.0)).array()).matrix(),
+                    constvec<dim>(0.5).cwiseProduct(Eigen::square((fx - constvec<dim>(0.5)).array()).matrix())};
+
+            // Block and block-local parts of the node index along every axis
+            std::array<std::array<int, 3>, dim> block, local;
+            int block_stride = 1, local_stride = 1;
+            for (int dd = dim - 1; dd >= 0; --dd) {
+                for (int oo = 0; oo < 3; ++oo) {
+                    block[dd][oo] = (base_coord(dd) + oo) / kFineSide * block_stride;
+                    local[dd][oo] = (base_coord(dd) + oo) % kFineSide * local_stride;
+                }
+                block_stride *= refine_blocks_;
+                local_stride *= kFineSide;
+            }
+            const auto node = [this](int block_index, int local_index) -> int {
+                const int slot = fine_slot_[block_index];
+                return slot < 0 ? -1 : slot * kFineNodes + local_index;
+            };
+
+            for (int ii = 0; ii < 3; ++ii) {
+                for (int jj = 0; jj < 3; ++jj) {
+                    if constexpr (dim == 3) {
+                        for (int kk = 0; kk < 3; ++kk) {
+                            fn(node(block[0][ii] + block[1][jj] + block[2][kk],
+                                    local[0][ii] + local[1][jj] + local[2][kk]),
+                               w[ii][0] * w[jj][1] * w[kk][2], Vector<real, dim>(ii, jj, kk) - fx);
                         }
+                    } else {
+                        fn(node(block[0][ii] + block[1][jj], local[0][ii] + local[1][jj]), w[ii][0] * w[jj][1],
+                           Vector<real, dim>(ii, jj) - fx);
                     }
                 }
+            }
+        }
 
-                // Advection
-                p.x += dt_ * p.v;
-                Matrix<real, dim> _F = (diag<dim>(1) + dt_ * p.C) * p.F;
+        /**
+         * P2G of the `share` of a particle that the fine grid carries. The stress part of `affine` scales with
+         * 1 / spacing^2, so at half the spacing it is four times the coarse one while the APIC part m C stays the
+         * same.
+         */
+        inline auto scatter_fine(const Particle<dim> &p, const Matrix<real, dim> &affine, const real share) -> void {
+            const Matrix<real, dim> fine_affine = share * (4 * affine - 3 * p.mass * p.C);
+            const Vector<real, dim> momentum = share * p.v * p.mass;
+            const real mass = share * p.mass;
+            const real fine_dx = dx_ / 2;
+            for_each_fine_node(p.x, [&](int index, real weight, const Vector<real, dim> &dpos) {
+                // A positive share keeps the stencil within a refined block's neighbors, guard against the rest
+                if (index < 0) { return; }
+                auto &g = fine_cells_[index];
+                g.velocity += weight * (momentum + fine_affine * (dpos * fine_dx));
+                g.mass += weight * mass;
+            });
+        }
 
-                if (material_model_ == MaterialModel::kJelly) {
-                    // MLS-MPM F-update for non-compressive elastic materials
-                    p.F = _F;
-                } else {
-                    Matrix<real, dim> U, sig, V;
-                    nclr_svd(_F, U, sig, V);
+        // G2P from the fine grid, the stencil of a particle with a fine share always lies on allocated nodes
+        inline auto gather_fine(Particle<dim> &p) -> void {
+            const real inv_dx = 2 * inv_dx_;
+            p.C = constmat<dim>(0);
+            p.v = constvec<dim>(0);
+            for_each_fine_node(p.x, [&](int index, real weight, const Vector<real, dim> &dpos) {
+                const Vector<real, dim> &grid_v = fine_cells_[index].velocity;
+                p.v += weight * grid_v;
+                p.C += 4 * inv_dx * (weight * grid_v) * dpos.transpose();
+            });
+        }
 
-                    if (material_model_ == MaterialModel::kSnow) {
-                        // Plasticity operation on sigma
-#pragma unroll
-                        for (int dd = 0; dd < dim; ++dd) {
-                            sig(dd, dd) = std::clamp(sig(dd, dd), real(1.0 - 2.5e-2), real(1.0 + 4.5e-3));
-                        }
+        /**
+         * Rebuilds the refined set: blocks with a surface cell or a straining particle are refined, unless a
+         * sleeping block is next to them (the fine grid doesn't carry sleeping mass), and the blocks around them
+         * get fine nodes as well.
+         */
+        inline auto update_refinement() -> void {
+            int cells = 1;
+            for (int dd = 0; dd < dim; ++dd) { cells *= res_; }
+
+            std::vector<int> counts(cells, 0);
+            std::vector<uint8_t> flagged(refined_.size(), 0);
+            for (const auto &p : particles_) {
+                const int cell = cell_index(p.x);
+                if (cell < 0) { continue; }
+                ++counts[cell];
+                if (strain(p) > refine_.strain) { flagged[block_of_cell(cell)] = 1; }
+            }
+            const std::vector<uint8_t> surface = surface_cells([&counts](int cell) { return counts[cell] > 0; });
+            for (int cell = 0; cell < cells; ++cell) {
+                if (surface[cell]) { flagged[block_of_cell(cell)] = 1; }
+            }
+
+            std::fill(refined_.begin(), refined_.end(), kCoarse);
+            for (int block = 0; block < int(refined_.size()); ++block) {
+                if (!flagged[block]) { continue; }
+                bool near_sleep = false;
+                for_each_block_around(block, [&](int neighbor) {
+                    if (sleep_.enabled && asleep_[neighbor]) { near_sleep = true; }
+                });
+                if (!near_sleep) { refined_[block] = kRefined; }
+            }
+            for (int block = 0; block < int(refined_.size()); ++block) {
+                if (refined_[block] != kRefined) { continue; }
+                for_each_block_around(block, [&](int neighbor) {
+                    if (refined_[neighbor] == kCoarse) { refined_[neighbor] = kRing; }
+                });
+            }
+
+            fine_blocks_.clear();
+            for (int block = 0; block < int(refined_.size()); ++block) {
+                fine_slot_[block] = refined_[block] == kCoarse ? -1 : int(fine_blocks_.size());
+                if (refined_[block] != kCoarse) { fine_blocks_.push_back(block); }
+            }
+            fine_cells_.resize(fine_blocks_.size() * kFineNodes);
+            refine_dirty_ = false;
+        }
+
+        inline auto block_of_cell(const int cell) const -> int {
+            int block = 0, stride = 1, block_stride = 1;
+            for (int dd = dim - 1; dd >= 0; --dd) {
+                block += ((cell / stride) % res_) / kRefineBlock * block_stride;
+                stride *= res_;
+                block_stride *= refine_blocks_;
+            }
+            return block;
+        }
 
-                        const auto old_J = _F.determinant();
-                        _F = U * sig * V.transpose();
-                        p.Jp = std::clamp(p.Jp * old_J / _F.determinant(), real(0.6), real(20.0));
-                        p.F = _F;
+        // Calls fn(neighbor) for the blocks in the 3^dim neighborhood of a block, itself included
+        template<typename Fn>
+        inline auto for_each_block_around(const int block, Fn &&fn) const -> void {
+            Vector<int, dim> coord;
+            for (int dd = dim - 1, rest = block; dd >= 0; --dd, rest /= refine_blocks_) {
+                coord(dd) = rest % refine_blocks_;
+            }
+            for (int offset = 0; offset < kStencil; ++offset) {
+                int neighbor = 0;
+                bool inside = true;
+                for (int dd = 0, rest = offset; dd < dim; ++dd, rest /= 3) {
+                    const int c = coord(dd) + rest % 3 - 1;
+                    inside = inside && c >= 0 && c < refine_blocks_;
+                    neighbor = neighbor * refine_blocks_ + c;
+                }
+                if (inside) { fn(neighbor); }
+            }
+        }
+
+        SleepSettings sleep_;
+        int sleep_blocks_ = 0;
+        std::vector<uint8_t> asleep_;
+        std::vector<int> calm_steps_;
+
+        // Per block scratch for the current step
+        std::vector<uint8_t> restless_;
+        std::vector<uint8_t> occupied_;
+        std::vector<uint8_t> woken_;
+
+        // Mass the sleeping particles add to each node, rebuilt when the sleeping set changes
+        std::vector<real> sleeping_mass_;
+        bool sleeping_mass_dirty_ = true;
+        std::size_t sleeping_ = 0;
+
+        // Sleep block holding x, or -1 outside the domain
+        inline auto sleep_block(const Vector<real, dim> &x) const -> int {
+            if (!in_domain(x)) { return -1; }
+            int block = 0;
+            for (int dd = 0; dd < dim; ++dd) {
+                block = block * sleep_blocks_ + std::min(int(x(dd) * inv_dx_) / kSleepBlock, sleep_blocks_ - 1);
+            }
+            return block;
+        }
+
+        inline auto is_asleep(const Vector<real, dim> &x) const -> bool {
+            const int block = sleep_block(x);
+            return block >= 0 && asleep_[block];
+        }
+
+        inline auto wake_at(const Vector<real, dim> &x) -> void {
+            const int block = sleep_block(x);
+            if (block < 0 || !asleep_[block]) { return; }
+            asleep_[block] = 0;
+            calm_steps_[block] = 0;
+            sleeping_mass_dirty_ = true;
+        }
+
+        // Records whether an awake particle (with the change of F its trial F makes) is still moving, after advection
+        inline auto note_rest(const Particle<dim> &p, const Matrix<real, dim> &dF) -> void {
+            const int block = sleep_block(p.x);
+            if (block < 0) { return; }
+            occupied_[block] = 1;
+            if (p.v.norm() > sleep_.velocity || dF.cwiseAbs().maxCoeff() > sleep_.deformation) {
+                restless_[block] = 1;
+                // Moving into a sleeping block wakes it
+                if (asleep_[block] && p.v.norm() > sleep_.wake_velocity) { woken_[block] = 1; }
+            }
+        }
+
+        // Puts calm blocks to sleep and wakes the disturbed ones at the end of a step
+        inline auto update_sleep() -> void {
+            bool changed = false;
+            for (std::size_t bb = 0; bb < asleep_.size(); ++bb) {
+                if (woken_[bb]) {
+                    asleep_[bb] = 0;
+                    calm_steps_[bb] = 0;
+                    changed = true;
+                } else if (!asleep_[bb]) {
+                    calm_steps_[bb] = occupied_[bb] && !restless_[bb] ? calm_steps_[bb] + 1 : 0;
+                    if (calm_steps_[bb] >= sleep_.steps) {
+                        asleep_[bb] = 1;
+                        changed = true;
                     }
+                }
+            }
+            std::fill(restless_.begin(), restless_.end(), 0);
+            std::fill(occupied_.begin(), occupied_.end(), 0);
+            std::fill(woken_.begin(), woken_.end(), 0);
+            if (!changed) { return; }
+
+            // Sleeping particles are at rest, so they add mass but no momentum
+            sleeping_mass_dirty_ = true;
+            refine_dirty_ = true;
+            sleeping_ = 0;
+            for (auto &p : particles_) {
+                if (!is_asleep(p.x)) { continue; }
+                p.v = constvec<dim>(0);
+                p.C = constmat<dim>(0);
+                ++sleeping_;
+            }
+        }
 
-                    if (material_model_ == MaterialModel::kLiquid) {
-                        auto J = 1.0;
-                        for (int dd = 0; dd < dim; ++dd) { J *= sig(dd, dd); }
-                        // Reset the deformation gradient to avoid numerical explosion
-                        p.F = diag<dim>(1.0);
-                        p.F(0, 0) = J;
+        inline auto add_sleeping_mass() -> void {
+            if (sleeping_mass_dirty_) {
+                sleeping_mass_.assign(grid_size(), 0);
+                for (const auto &p : particles_) {
+                    if (!is_asleep(p.x)) { continue; }
+                    const Vector<int, dim> base_coord = (p.x * inv_dx_ - constvec<dim>(0.5)).template cast<int>();
+                    const Vector<real, dim> fx = p.x * inv_dx_ - base_coord.template cast<real>();
+                    const std::array<Vector<real, dim>, 3> w{
+                            constvec<dim>(0.5).cwiseProduct(Eigen::square((constvec<dim>(1.5) - fx).array()).matrix()),
+                            constvec<dim>(0.75) - Eigen::square((fx - constvec<dim>(1.0)).array()).matrix(),
+                            constvec<dim>(0.5).cwiseProduct(Eigen::square((fx - constvec<dim>(0.5)).array()).matrix())};
+                    for (int offset = 0; offset < kStencil; ++offset) {
+                        real weight = p.mass;
+                        int index = 0;
+                        for (int dd = 0, rest = offset; dd < dim; ++dd, rest /= 3) {
+                            weight *= w[rest % 3](dd);
+                            index = index * (res_ + 1) + base_coord(dd) + rest % 3;
+                        }
+                        sleeping_mass_[index] += weight;
+                    }
+                }
+                sleeping_mass_dirty_ = false;
+            }
+            for (std::size_t ii = 0; ii < sleeping_mass_.size(); ++ii) { cells_[ii].mass += sleeping_mass_[ii]; }
+        }
+
+        /**
+         * Nodes carrying sleeping mass are held still, unless the awake particles around them push them past the
+         * wake velocity, which wakes every sleeping block whose particles reach the node.
+         */
+        inline auto hold_sleeping_nodes() -> void {
+            for (int index = 0; index < grid_size(); ++index) {
+                if (sleeping_mass_[index] <= 0) { continue; }
+                auto &g = cells_[index];
+                if (g.velocity.norm() <= sleep_.wake_velocity) {
+                    g.velocity = constvec<dim>(0);
+                    continue;
+                }
+
+                // Particles in cells [node - 2, node + 1] have this node in their stencil
+                Vector<int, dim> lo, hi;
+                for (int dd = dim - 1, rest = index; dd >= 0; --dd, rest /= res_ + 1) {
+                    const int node = rest % (res_ + 1);
+                    lo(dd) = std::max(node - 2, 0) / kSleepBlock;
+                    hi(dd) = std::min((node + 1) / kSleepBlock, sleep_blocks_ - 1);
+                }
+                if constexpr (dim == 3) {
+                    for (int bx = lo(0); bx <= hi(0); ++bx) {
+                        for (int by = lo(1); by <= hi(1); ++by) {
+                            for (int bz = lo(2); bz <= hi(2); ++bz) {
+                                const int block = (bx * sleep_blocks_ + by) * sleep_blocks_ + bz;
+                                if (asleep_[block]) { woken_[block] = 1; }
+                            }
+                        }
+                    }
+                } else {
+                    for (int bx = lo(0); bx <= hi(0); ++bx) {
+                        for (int by = lo(1); by <= hi(1); ++by) {
+                            const int block = bx * sleep_blocks_ + by;
+                            if (asleep_[block]) { woken_[block] = 1; }
+                        }
                     }
                 }
             }
@@ -270,19 +1554,46 @@ namespace nclr {
                             auto &g = cells_.at(index);
                             grid_normalization(g);
                             sticky_boundary(Vector<real, dim>(ii, jj, kk), g);
+                            collide(Vector<real, dim>(ii, jj, kk), g);
                         }
                     } else {
                         const auto index = (ii * (res_ + 1)) + jj;
                         auto &g = cells_.at(index);
                         grid_normalization(g);
                         sticky_boundary(Vector<real, dim>(ii, jj), g);
+                        collide(Vector<real, dim>(ii, jj), g);
                     }
                 }
             }
+
+            if (sleep_.enabled) { hold_sleeping_nodes(); }
+            if (refine_.enabled) { fine_grid_op(); }
         }
 
-        inline auto grid_normalization(Cell<dim> &cell) -> void {
-            const real allowed_velocity = dx_ * 0.9 / dt_;
+        // Same as grid_op() on the fine nodes, with half the spacing
+        inline auto fine_grid_op() -> void {
+            parallel_for(int(fine_blocks_.size()), pool(), [this](int slot) {
+                Vector<int, dim> block_coord;
+                for (int dd = dim - 1, rest = fine_blocks_[slot]; dd >= 0; --dd, rest /= refine_blocks_) {
+                    block_coord(dd) = rest % refine_blocks_;
+                }
+                for (int local = 0; local < kFineNodes; ++local) {
+                    auto &g = fine_cells_[slot * kFineNodes + local];
+                    Vector<real, dim> indices;
+                    for (int dd = dim - 1, rest = local; dd >= 0; --dd, rest /= kFineSide) {
+                        indices(dd) = real(block_coord(dd) * kFineSide + rest % kFineSide) / 2;
+                    }
+                    grid_normalization(g, dx_ / 2);
+                    sticky_boundary(indices, g);
+                    collide(indices, g);
+                }
+            });
+        }
+
+        // Normalizes a node's momentum and applies gravity, `spacing` bounds the velocity to 0.9 cells per step
+        inline auto grid_normalization(Cell<dim> &cell) -> void { grid_normalization(cell, dx_); }
+        inline auto grid_normalization(Cell<dim> &cell, const real spacing) -> void {
+            const real allowed_velocity = grid_velocity_limit(spacing, dt_);
             // No need for epsilon here
             if (cell.mass > 0.0) {
                 // Normalize by mass
@@ -309,23 +1620,54 @@ namespace nclr {
             }
         }
 
+        inline auto collide(const Vector<real, dim> &indices, Cell<dim> &cell) -> void {
+            const Vector<real, dim> position = indices * dx_;
+            for (const auto &collider : colliders_) {
+                // Signed distance and outward normal of the collider at this node
+                real phi;
+                Vector<real, dim> normal;
+                if (collider.shape == ColliderShape::kPlane) {
+                    normal = collider.normal;
+                    phi = (position - collider.position).dot(normal);
+                } else {
+                    const Vector<real, dim> offset = position - collider.position;
+                    phi = offset.norm() - collider.radius;
+                    normal = offset.norm() > 0 ? Vector<real, dim>(offset.normalized()) : constvec<dim>(0);
+                }
+
+                if (phi >= 0) { continue; }
+
+                if (collider.sticky) {
+                    cell.velocity = constvec<dim>(0);
+                } else {
+                    const real inward = cell.velocity.dot(normal);
+                    if (inward < 0) { cell.velocity -= inward * normal; }
+                }
+            }
+        }
+
         // Utilities ==============================================
-        inline auto first_piola_kirchoff_stress(const Particle<dim> &p) -> Matrix<real, dim> {
+        inline auto first_piola_kirchoff_stress(const std::size_t pp) -> Matrix<real, dim> {
+            const auto &p = particles_[pp];
+            if (material_model_ == MaterialModel::kLiquid) { return liquid_stress(p); }
+
             // Compute current Lamé parameters [http://mpm.graphics Eqn. 86] (for snow)
             const auto &[mu, lambda] = hardening(p);
 
+            const Matrix<real, dim> &F = deformations_[pp];
+
             // Current volume
-            const real J = p.F.determinant();
+            const real J = F.determinant();
 
-            // Polar decomposition for fixed corotated model
-            Matrix<real, dim> r, s;
-            nclr_polar(p.F, r, s);
+            // Rotation of the polar decomposition for the fixed corotated model, kept up to date by g2p()
+            const Matrix<real, dim> &r = rotations_[pp];
 
             // [http://mpm.graphics Paragraph after Eqn. 176]
             const real Dinv = 4 * inv_dx_ * inv_dx_;
 
             // [http://mpm.graphics Eqn. 52]
-            const Matrix<real, dim> PF = (2 * mu * (p.F - r) * p.F.transpose() + constmat<dim>(lambda * (J - 1) * J));
+            const Matrix<real, dim> PF =
+                    2 * mu * (F - r) * F.transpose() + constmat<dim>(corotated_volume_term(lambda, J));
 
             // Cauchy stress times dt and inv_dx
             const Matrix<real, dim> stress = -(dt_ * p.volume) * (Dinv * PF);
@@ -336,6 +1678,14 @@ namespace nclr {
             return stress + p.mass * p.C;// Affine MLS-MPM Stress update
         }
 
+        // Pressure only for liquids, see liquid_pressure()
+        inline auto liquid_stress(const Particle<dim> &p) -> Matrix<real, dim> {
+            const auto &[mu, lambda] = constant_hardening(kLiquidHardening);
+            const real Dinv = 4 * inv_dx_ * inv_dx_;
+            const real pressure = liquid_pressure<dim>(mu, lambda, p.Jp);
+            return diag<dim>(-(dt_ * p.volume) * Dinv * pressure) + p.mass * p.C;
+        }
+
         // TODO(@jparr721) - Implement neo-hookean stress model.
 
         /**
@@ -353,8 +1703,7 @@ namespace nclr {
         }
 
         inline auto snow_hardening(const Particle<dim> &p) -> std::pair<real, real> {
-            const auto e = std::exp(kSnowHardening * (1.0 - p.Jp));
-            return constant_hardening(e);
+            return constant_hardening(snow_hardening_factor(kSnowHardening, p.Jp));
         }
 
         inline auto hardening(const Particle<dim> &p) -> std::pair<real, real> {
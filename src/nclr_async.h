@@ -0,0 +1,125 @@
+#pragma once
+
+#include "nclr.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace nclr {
+    /**
+     * Runs an MPMSimulation on its own thread and hands the state to one reader (typically a render loop) through a
+     * snapshot channel, so a slow reader never stalls the simulation. The simulation is owned by the worker while it
+     * runs, only latest() may be called from the reader thread.
+     */
+    template<int dim>
+    class AsyncSimulation {
+    public:
+        /**
+         * Starts stepping right away, publishing a snapshot every `publish_every` steps. `max_steps` of 0 runs until
+         * stop() or destruction.
+         */
+        AsyncSimulation(std::unique_ptr<MPMSimulation<dim>> sim, int publish_every, SnapshotFields fields = {},
+                        std::size_t max_steps = 0)
+            : sim_(std::move(sim)), channel_(sim_->add_snapshot_channel(fields, publish_every)),
+              max_steps_(max_steps) {
+            worker_ = std::thread([this]() -> void {
+                while (!stop_.load(std::memory_order_relaxed) && (max_steps_ == 0 || sim_->steps() < max_steps_)) {
+                    sim_->advance();
+                }
+                done_ = true;
+            });
+        }
+
+        AsyncSimulation(const AsyncSimulation &) = delete;
+        auto operator=(const AsyncSimulation &) -> AsyncSimulation & = delete;
+
+        ~AsyncSimulation() { stop(); }
+
+        // Newest published snapshot, valid until the next call (see TripleBuffer::read())
+        auto latest() -> const Snapshot<dim> * { return channel_->read(); }
+
+        // True once the worker has reached max_steps or was stopped
+        auto done() const -> bool { return done_; }
+
+        // Stops the worker after its current step, the simulation can be inspected afterwards
+        auto stop() -> void {
+            stop_ = true;
+            if (worker_.joinable()) { worker_.join(); }
+        }
+
+        auto simulation() const -> const MPMSimulation<dim> & { return *sim_; }
+
+    private:
+        std::unique_ptr<MPMSimulation<dim>> sim_;
+        std::shared_ptr<SnapshotChannel<dim>> channel_;
+        const std::size_t max_steps_;
+
+        std::atomic<bool> stop_ = false;
+        std::atomic<bool> done_ = false;
+        std::thread worker_;
+    };
+
+    /**
+     * A worker thread that runs `fn` on every pushed item in order, for output (meshing, compression, disk writes)
+     * that shouldn't hold up the simulation. At most `capacity` items wait at a time, push() blocks beyond that so
+     * a slow writer applies back pressure instead of buffering the whole run. Unlike a snapshot channel, no item
+     * is ever dropped. The destructor finishes the queue before joining.
+     */
+    template<typename T>
+    class AsyncWriter {
+    public:
+        explicit AsyncWriter(std::function<void(T &)> fn, std::size_t capacity = 2)
+            : fn_(std::move(fn)), capacity_(std::max<std::size_t>(capacity, 1)) {
+            worker_ = std::thread([this]() -> void {
+                while (true) {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    ready_.wait(lock, [this]() { return !queue_.empty() || closed_; });
+                    if (queue_.empty()) { return; }
+                    T item = std::move(queue_.front());
+                    queue_.pop_front();
+                    lock.unlock();
+                    space_.notify_one();
+                    fn_(item);
+                }
+            });
+        }
+
+        AsyncWriter(const AsyncWriter &) = delete;
+        auto operator=(const AsyncWriter &) -> AsyncWriter & = delete;
+
+        ~AsyncWriter() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+            }
+            ready_.notify_one();
+            worker_.join();
+        }
+
+        auto push(T item) -> void {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                space_.wait(lock, [this]() { return queue_.size() < capacity_; });
+                queue_.push_back(std::move(item));
+            }
+            ready_.notify_one();
+        }
+
+    private:
+        std::function<void(T &)> fn_;
+        const std::size_t capacity_;
+
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::condition_variable space_;
+        std::deque<T> queue_;
+        bool closed_ = false;
+        std::thread worker_;
+    };
+}// namespace nclr
@@ -0,0 +1,484 @@
+#pragma once
+
+#include "nclr.h"
+#include <Eigen/Dense>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace nclr {
+    template<int dim, int W>
+    struct BatchedParticle {
+        // Position
+        LaneVector<dim, W> x;
+
+        // Velocity
+        LaneVector<dim, W> v;
+
+        // Deformation gradient, starting at the identity (liquid lanes leave it there)
+        LaneMatrix<dim, W> F;
+
+        // Affine momentum from APIC
+        LaneMatrix<dim, W> C;
+
+        // Determinant of the deformation gradient (i.e. volume)
+        Lanes<W> Jp;
+
+        // Mass (Shared by every lane)
+        real mass;
+
+        // Volume (Shared by every lane)
+        real volume;
+
+        // Color
+        int c;
+
+        explicit BatchedParticle(const Particle<dim> &p)
+            : x(p.x.transpose().replicate(W, 1)), v(p.v.transpose().replicate(W, 1)),
+              F(Eigen::Map<const Eigen::Matrix<real, 1, dim * dim>>(diag<dim>(1).data()).replicate(W, 1)),
+              C(Eigen::Map<const Eigen::Matrix<real, 1, dim * dim>>(p.C.data()).replicate(W, 1)),
+              Jp(Lanes<W>::Constant(p.Jp)), mass(p.mass), volume(p.volume), c(p.c) {}
+    };
+
+    template<int dim, int W>
+    struct BatchedCell {
+        LaneVector<dim, W> velocity;
+        Lanes<W> mass;
+        BatchedCell() : velocity(LaneVector<dim, W>::Zero()), mass(Lanes<W>::Zero()) {}
+    };
+
+    /**
+     * Runs W independent simulations of the same scene at once, with one SIMD lane per simulation. Every
+     * simulation shares the grid resolution, timestep and initial particles, and may differ in E, nu, gravity and
+     * material model. All of the per-particle math (kernel weights, stress, APIC transfer and the F update) runs
+     * across the lanes in one go; only the grid scatter/gather and the SVD-based plasticity are done lane by lane
+     * since each lane's particle sits in its own cell.
+     *
+     * Each lane follows the scalar MPMSimulation of the same scene up to rounding, not bit for bit: the scalar
+     * solver keeps the snow rotation from its plasticity SVD and refines the jelly rotation by Newton steps, while
+     * this one decomposes F afresh every step. tests/test_batched.cpp holds the two to 1e-4 of the domain in
+     * particle positions and 5e-3 in Jp over 100 steps.
+     *
+     * With set_threads(), the stress, the grid update and g2p are spread over particles and grid nodes. The
+     * scatter of p2g stays on one thread, as the lanes of neighboring particles land on the same nodes.
+     *
+     * The material laws (hardening, the corotated volume term, liquid pressure, the grid velocity limit, and the F
+     * and J updates) are the shared helpers MPMSimulation uses, so they can't drift apart. The transfers are
+     * written for lanes and only cover the plain scene. This class has no equivalent of MPMSimulation's sources,
+     * sinks, colliders, sleeping, adaptive resolution, two-level grid or snapshot channels, and
+     * escaping lanes are always clamped (kClamp). A run that needs any of these has to use MPMSimulation, and the
+     * solver rejects --escape policies other than clamp together with --batched.
+     */
+    template<int dim, int W>
+    class BatchedMPMSimulation {
+    public:
+        const Lanes<W> mu_0;
+        const Lanes<W> lambda_0;
+
+        BatchedMPMSimulation(const std::vector<Particle<dim>> &particles, const std::array<MaterialModel, W> &models,
+                             int res, real dt, const Lanes<W> &E, const Lanes<W> &nu, const Lanes<W> &gravity,
+                             real extent = 1.0)
+            : mu_0(E / (2 * (1 + nu))), lambda_0(E * nu / ((1 + nu) * (1 - 2 * nu))), models_(models), res_(res),
+              dt_(dt), dx_(extent / res), inv_dx_(1 / dx_), gravity_(gravity) {
+            for (int ll = 0; ll < W; ++ll) {
+                is_snow_(ll) = models.at(ll) == MaterialModel::kSnow;
+                is_liquid_(ll) = models.at(ll) == MaterialModel::kLiquid;
+                hardening_(ll) = models.at(ll) == MaterialModel::kJelly ? MPMSimulation<dim>::kJellyHardening
+                                                                         : MPMSimulation<dim>::kLiquidHardening;
+            }
+
+            particles_.reserve(particles.size());
+            for (const auto &p : particles) {
+                particles_.emplace_back(p);
+                clamp(particles_.back());
+            }
+        }
+
+        auto advance() -> void {
+            p2g();
+            grid_op();
+            g2p();
+        }
+
+        // Same contract as MPMSimulation::advance(n_steps, callback_every, callback)
+        template<typename Callback>
+        auto advance(int n_steps, int callback_every, Callback &&callback) -> void {
+            for (int step = 0; step < n_steps; ++step) {
+                if (callback_every > 0 && step % callback_every == 0) { callback(step, std::as_const(*this)); }
+                advance();
+            }
+            if (callback_every > 0) { callback(n_steps, std::as_const(*this)); }
+        }
+
+        // Lanes of particles clamped back into the domain so far, counted once per lane and step
+        auto escaped_particles() const -> std::size_t { return escaped_; }
+
+        // Threads for the stress, grid update and g2p, 0 picks one per core, parked between steps (see WorkerPool)
+        auto set_threads(int threads) -> void { pool_ = std::make_unique<WorkerPool>(threads); }
+
+        auto res() const -> int { return res_; }
+        auto dt() const -> real { return dt_; }
+        auto dx() const -> real { return dx_; }
+
+        // Number of grid nodes, (res + 1)^dim
+        auto grid_size() const -> int {
+            int size = 1;
+            for (int dd = 0; dd < dim; ++dd) { size *= res_ + 1; }
+            return size;
+        }
+
+        // Copies the particles of a single simulation out of the batch
+        auto particles(const int lane) const -> std::vector<Particle<dim>> {
+            std::vector<Particle<dim>> particles;
+            particles.reserve(particles_.size());
+            for (const auto &bp : particles_) {
+#ifdef NCLR_UNIFORM_MASS
+                Particle<dim> p(bp.x.row(lane).transpose(), bp.c, bp.v.row(lane).transpose());
+#else
+                Particle<dim> p(bp.x.row(lane).transpose(), bp.c, bp.v.row(lane).transpose(), bp.mass, bp.volume);
+#endif
+                p.C = lane_matrix(bp.C, lane);
+                p.Jp = bp.Jp(lane);
+                particles.push_back(p);
+            }
+            return particles;
+        }
+
+        // Copies the deformation gradients of a single simulation out of the batch, like MPMSimulation::deformations()
+        auto deformations(const int lane) const -> std::vector<Matrix<real, dim>> {
+            std::vector<Matrix<real, dim>> deformations;
+            if (models_.at(lane) == MaterialModel::kLiquid) { return deformations; }
+            deformations.reserve(particles_.size());
+            for (const auto &bp : particles_) { deformations.push_back(lane_matrix(bp.F, lane)); }
+            return deformations;
+        }
+
+        // Copies the grid of a single simulation out of the batch
+        auto grid(const int lane) const -> std::vector<Cell<dim>> {
+            std::vector<Cell<dim>> cells(cells_.size());
+            for (std::size_t index = 0; index < cells_.size(); ++index) {
+                cells.at(index).velocity = cells_.at(index).velocity.row(lane).transpose();
+                cells.at(index).mass = cells_.at(index).mass(lane);
+            }
+            return cells;
+        }
+
+    private:
+        const std::array<MaterialModel, W> models_;
+
+        const int res_;
+
+        const real dt_;
+        const real dx_;
+        const real inv_dx_;
+        const Lanes<W> gravity_;
+
+        // Snow lanes harden with Jp, the others use the constant in hardening_
+        Eigen::Array<bool, W, 1> is_snow_;
+        Lanes<W> hardening_;
+
+        // Liquid lanes keep J in Jp and only feel pressure, see MPMSimulation::liquid_stress()
+        Eigen::Array<bool, W, 1> is_liquid_;
+
+        std::vector<BatchedCell<dim, W>> cells_;
+        std::vector<BatchedParticle<dim, W>> particles_;
+
+        std::unique_ptr<WorkerPool> pool_ = std::make_unique<WorkerPool>(1);
+
+        std::atomic<std::size_t> escaped_ = 0;
+
+        // Fused stress and APIC matrix of every particle, formed in parallel before the scatter
+        std::vector<LaneMatrix<dim, W>> affine_;
+
+        inline auto p2g() -> void {
+            constexpr std::size_t kBlockSize = 64;
+
+            cells_ = std::vector<BatchedCell<dim, W>>(grid_size(), BatchedCell<dim, W>());
+
+            affine_.resize(particles_.size());
+            parallel_blocks(particles_.size(), kBlockSize, *pool_, [this](std::size_t begin, std::size_t end) {
+                for (std::size_t pp = begin; pp < end; ++pp) {
+                    affine_[pp] = first_piola_kirchoff_stress(particles_[pp]);
+                }
+            });
+
+            for (std::size_t pp = 0; pp < particles_.size(); ++pp) {
+                const auto &p = particles_[pp];
+                const LaneVector<dim, W> scaled = p.x * inv_dx_;
+                const Eigen::Array<int, W, dim> base_coord = (scaled - 0.5).template cast<int>();
+                const LaneVector<dim, W> fx = scaled - base_coord.template cast<real>();
+
+                // Quadratic kernels [http://mpm.graphics Eqn. 123, with x=fx, fx-1,fx-2]
+                const std::array<LaneVector<dim, W>, 3> w{0.5 * (1.5 - fx).square(), 0.75 - (fx - 1.0).square(),
+                                                          0.5 * (fx - 0.5).square()};
+
+                const LaneMatrix<dim, W> &affine = affine_[pp];
+
+                // Particle momentum is the same for every node in the stencil
+                const LaneVector<dim, W> momentum = p.v * p.mass;
+
+                for_each_node([&](const Vector<int, dim> &node) {
+                    Lanes<W> weight = Lanes<W>::Ones();
+                    LaneVector<dim, W> dpos;
+                    for (int dd = 0; dd < dim; ++dd) {
+                        weight *= w[node(dd)].col(dd);
+                        dpos.col(dd) = (real(node(dd)) - fx.col(dd)) * dx_;
+                    }
+
+                    // affine * dpos, lane-wise
+                    LaneVector<dim, W> contribution = momentum;
+                    for (int rr = 0; rr < dim; ++rr) {
+                        for (int cc = 0; cc < dim; ++cc) {
+                            contribution.col(rr) += affine.col(rr + cc * dim) * dpos.col(cc);
+                        }
+                    }
+                    contribution.colwise() *= weight;
+                    const Lanes<W> mass = weight * p.mass;
+
+                    for (int ll = 0; ll < W; ++ll) {
+                        auto &cell = cells_.at(index(base_coord.row(ll).transpose().matrix() + node));
+                        cell.velocity.row(ll) += contribution.row(ll);
+                        cell.mass(ll) += mass(ll);
+                    }
+                });
+            }
+        }
+
+        inline auto grid_op() -> void {
+            constexpr std::size_t kBlockSize = 1024;
+
+            parallel_blocks(cells_.size(), kBlockSize, *pool_, [this](std::size_t begin, std::size_t end) {
+                for (std::size_t index = begin; index < end; ++index) { grid_op(index); }
+            });
+        }
+
+        inline auto grid_op(const std::size_t index) -> void {
+            const real allowed_velocity = grid_velocity_limit(dx_, dt_);
+            auto &g = cells_.at(index);
+
+            // Normalize by mass, apply gravity to the Y axis and clip, only where the lane has mass
+            const auto has_mass = g.mass > 0;
+            for (int dd = 0; dd < dim; ++dd) {
+                Lanes<W> velocity = g.velocity.col(dd) / has_mass.select(g.mass, 1);
+                if (dd == 1) { velocity += has_mass.select(dt_ * gravity_, 0); }
+                g.velocity.col(dd) = velocity.max(-allowed_velocity).min(allowed_velocity);
+            }
+
+            // Sticky boundary
+            const Vector<int, dim> indices = coord(index);
+            Eigen::Array<bool, W, 1> stick = Eigen::Array<bool, W, 1>::Constant(false);
+            for (int dd = 0; dd < dim; ++dd) {
+                if (indices(dd) < MPMSimulation<dim>::kBoundary) { stick = stick || g.velocity.col(dd) < 0; }
+                if (indices(dd) >= (res_ + 1) - MPMSimulation<dim>::kBoundary) {
+                    stick = stick || g.velocity.col(dd) > 0;
+                }
+            }
+            for (int dd = 0; dd < dim; ++dd) { g.velocity.col(dd) = stick.select(0, g.velocity.col(dd)); }
+            g.mass = stick.select(0, g.mass);
+        }
+
+        inline auto g2p() -> void {
+            constexpr std::size_t kBlockSize = 64;
+
+            parallel_blocks(particles_.size(), kBlockSize, *pool_, [this](std::size_t begin, std::size_t end) {
+                for (std::size_t pp = begin; pp < end; ++pp) { g2p(particles_[pp]); }
+            });
+        }
+
+        inline auto g2p(BatchedParticle<dim, W> &p) -> void {
+            const LaneVector<dim, W> scaled = p.x * inv_dx_;
+            const Eigen::Array<int, W, dim> base_coord = (scaled - 0.5).template cast<int>();
+            const LaneVector<dim, W> fx = scaled - base_coord.template cast<real>();
+
+            // Quadratic kernels [http://mpm.graphics Eqn. 123, with x=fx, fx-1,fx-2]
+            const std::array<LaneVector<dim, W>, 3> w{0.5 * (1.5 - fx).square(), 0.75 - (fx - 1.0).square(),
+                                                      0.5 * (fx - 0.5).square()};
+
+            p.C.setZero();
+            p.v.setZero();
+
+            for_each_node([&](const Vector<int, dim> &node) {
+                Lanes<W> weight = Lanes<W>::Ones();
+                LaneVector<dim, W> dpos;
+                for (int dd = 0; dd < dim; ++dd) {
+                    weight *= w[node(dd)].col(dd);
+                    dpos.col(dd) = real(node(dd)) - fx.col(dd);
+                }
+
+                LaneVector<dim, W> grid_v;
+                for (int ll = 0; ll < W; ++ll) {
+                    grid_v.row(ll) = cells_.at(index(base_coord.row(ll).transpose().matrix() + node)).velocity.row(ll);
+                }
+                grid_v.colwise() *= weight;
+
+                // Velocity
+                p.v += grid_v;
+
+                // APIC C
+                for (int rr = 0; rr < dim; ++rr) {
+                    for (int cc = 0; cc < dim; ++cc) {
+                        p.C.col(rr + cc * dim) += 4 * inv_dx_ * grid_v.col(rr) * dpos.col(cc);
+                    }
+                }
+            });
+
+            // Advection
+            p.x += dt_ * p.v;
+            clamp(p);
+
+            // Liquid lanes only advect J, F stays the identity
+            if (is_liquid_.all()) {
+                for (int ll = 0; ll < W; ++ll) { update_volume<dim>(lane_matrix(p.C, ll), dt_, p.Jp(ll)); }
+                return;
+            }
+
+            // (I + dt * C) * F, lane-wise
+            LaneMatrix<dim, W> _F = LaneMatrix<dim, W>::Zero();
+            for (int rr = 0; rr < dim; ++rr) {
+                for (int cc = 0; cc < dim; ++cc) {
+                    for (int kk = 0; kk < dim; ++kk) {
+                        const Lanes<W> step = dt_ * p.C.col(rr + kk * dim) + (rr == kk ? 1 : 0);
+                        _F.col(rr + cc * dim) += step * p.F.col(kk + cc * dim);
+                    }
+                }
+            }
+
+            for (int ll = 0; ll < W; ++ll) {
+                if (models_.at(ll) == MaterialModel::kLiquid) {
+                    update_volume<dim>(lane_matrix(p.C, ll), dt_, p.Jp(ll));
+                } else if (models_.at(ll) == MaterialModel::kJelly) {
+                    p.F.row(ll) = _F.row(ll);
+                } else {
+                    Matrix<real, dim> F;
+                    update_deformation<dim>(models_.at(ll), lane_matrix(_F, ll), F, p.Jp(ll));
+                    p.F.row(ll) = Eigen::Map<const Eigen::Matrix<real, 1, dim * dim>>(F.data()).array();
+                }
+            }
+        }
+
+        /**
+         * MPMSimulation's kClamp escape policy, lane-wise: a lane whose stencil would leave the grid (or whose
+         * position is NaN) is moved back onto the nearest face of [dx, (res - 1) dx] and stopped along that axis.
+         * The lanes share one particle list, so the other policies, which delete or skip particles, don't apply.
+         */
+        inline auto clamp(BatchedParticle<dim, W> &p) -> void {
+            const real lo = dx_, hi = (res_ - 1) * dx_;
+
+            // Written so that NaN compares as outside, and lands on the lower face
+            const Eigen::Array<bool, W, dim> inside = (p.x >= lo) && (p.x <= hi);
+            if (inside.all()) { return; }
+            escaped_ += (!inside.rowwise().all()).count();
+            for (int dd = 0; dd < dim; ++dd) {
+                const Lanes<W> face = (p.x.col(dd) > hi).select(hi, Lanes<W>::Constant(lo));
+                p.x.col(dd) = inside.col(dd).select(p.x.col(dd), face);
+                p.v.col(dd) = inside.col(dd).select(p.v.col(dd), 0);
+            }
+        }
+
+        // Utilities ==============================================
+        inline auto first_piola_kirchoff_stress(const BatchedParticle<dim, W> &p) -> LaneMatrix<dim, W> {
+            // Compute current Lamé parameters [http://mpm.graphics Eqn. 86] (for snow)
+            const Lanes<W> e =
+                    is_snow_.select(snow_hardening_factor(MPMSimulation<dim>::kSnowHardening, p.Jp), hardening_);
+            const Lanes<W> mu = mu_0 * e;
+            const Lanes<W> lambda = lambda_0 * e;
+
+            // Current volume
+            const Lanes<W> J = is_liquid_.select(p.Jp, determinant(p.F));
+
+            // Polar decomposition for fixed corotated model
+            const LaneMatrix<dim, W> r = rotation(p.F);
+
+            // [http://mpm.graphics Paragraph after Eqn. 176]
+            const real Dinv = 4 * inv_dx_ * inv_dx_;
+
+            // [http://mpm.graphics Eqn. 52], (F - R) * F^T lane-wise
+            LaneMatrix<dim, W> PF;
+            for (int rr = 0; rr < dim; ++rr) {
+                for (int cc = 0; cc < dim; ++cc) {
+                    Lanes<W> entry = Lanes<W>::Zero();
+                    for (int kk = 0; kk < dim; ++kk) {
+                        entry += (p.F.col(rr + kk * dim) - r.col(rr + kk * dim)) * p.F.col(cc + kk * dim);
+                    }
+                    PF.col(rr + cc * dim) = 2 * mu * entry + corotated_volume_term(lambda, J);
+                    if (rr == cc) {
+                        PF.col(rr + cc * dim) =
+                                is_liquid_.select(liquid_pressure<dim>(mu, lambda, J), PF.col(rr + cc * dim));
+                    } else {
+                        PF.col(rr + cc * dim) = is_liquid_.select(0, PF.col(rr + cc * dim));
+                    }
+                }
+            }
+
+            // Cauchy stress times dt and inv_dx, plus the fused APIC momentum
+            return -(dt_ * p.volume * Dinv) * PF + p.mass * p.C;
+        }
+
+        inline auto determinant(const LaneMatrix<dim, W> &m) -> Lanes<W> {
+            if constexpr (dim == 2) {
+                return m.col(0) * m.col(3) - m.col(2) * m.col(1);
+            } else {
+                return m.col(0) * (m.col(4) * m.col(8) - m.col(7) * m.col(5)) -
+                       m.col(3) * (m.col(1) * m.col(8) - m.col(7) * m.col(2)) +
+                       m.col(6) * (m.col(1) * m.col(5) - m.col(4) * m.col(2));
+            }
+        }
+
+        // Rotation from the polar decomposition, closed form across lanes in 2D and nclr_polar per lane in 3D
+        inline auto rotation(const LaneMatrix<dim, W> &m) -> LaneMatrix<dim, W> {
+            LaneMatrix<dim, W> r;
+            if constexpr (dim == 2) {
+                const Lanes<W> x = m.col(0) + m.col(3);
+                const Lanes<W> y = m.col(1) - m.col(2);
+                const Lanes<W> scale = (x * x + y * y).sqrt().inverse();
+                r.col(0) = x * scale;
+                r.col(1) = y * scale;
+                r.col(2) = -y * scale;
+                r.col(3) = x * scale;
+            } else {
+                for (int ll = 0; ll < W; ++ll) {
+                    Matrix<real, dim> R, S;
+                    nclr_polar<dim>(lane_matrix(m, ll), R, S);
+                    r.row(ll) = Eigen::Map<const Eigen::Matrix<real, 1, dim * dim>>(R.data()).array();
+                }
+            }
+            return r;
+        }
+
+        inline auto lane_matrix(const LaneMatrix<dim, W> &m, const int lane) const -> Matrix<real, dim> {
+            const Eigen::Matrix<real, 1, dim * dim> row = m.row(lane).matrix();
+            return Eigen::Map<const Matrix<real, dim>>(row.data());
+        }
+
+        template<typename Fn>
+        inline auto for_each_node(Fn &&fn) -> void {
+            for (int ii = 0; ii < 3; ++ii) {
+                for (int jj = 0; jj < 3; ++jj) {
+                    if constexpr (dim == 3) {
+                        for (int kk = 0; kk < 3; ++kk) { fn(Vector<int, dim>(ii, jj, kk)); }
+                    } else {
+                        fn(Vector<int, dim>(ii, jj));
+                    }
+                }
+            }
+        }
+
+        inline auto index(const Vector<int, dim> &node) const -> int {
+            int index = 0;
+            for (int dd = 0; dd < dim; ++dd) { index = index * (res_ + 1) + node(dd); }
+            return index;
+        }
+
+        inline auto coord(int index) const -> Vector<int, dim> {
+            Vector<int, dim> node;
+            for (int dd = dim - 1; dd >= 0; --dd) {
+                node(dd) = index % (res_ + 1);
+                index /= res_ + 1;
+            }
+            return node;
+        }
+    };
+}// namespace nclr
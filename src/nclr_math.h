@@ -1,5 +1,16 @@
+#pragma once
+
 #include <Eigen/Dense>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace nclr {
     template<typename T, int dim>
@@ -10,11 +21,23 @@ namespace nclr {
 
     using real = float;
 
+    // One value per lane, e.g. one simulation of a batch or one particle of a gather
+    template<int W>
+    using Lanes = Eigen::Array<real, W, 1>;
+
+    // Column d holds component d of every lane
+    template<int dim, int W>
+    using LaneVector = Eigen::Array<real, W, dim>;
+
+    // Column (r + c * dim) holds entry (r, c) of every lane
+    template<int dim, int W>
+    using LaneMatrix = Eigen::Array<real, W, dim * dim>;
+
     template<int dim>
     inline auto diag(const float value) -> Matrix<real, dim> {
         Matrix<real, dim> m = Matrix<real, dim>::Zero();
-        m(0, 0) = value;
-        m(1, 1) = value;
+#pragma unroll
+        for (int ii = 0; ii < dim; ++ii) { m(ii, ii) = value; }
         return m;
     }
 
@@ -60,14 +83,15 @@ namespace nclr {
 
         Vector<real, dim> values = svd.singularValues();
 
+        // Flip the smallest singular value so U and V are proper rotations
         if (U.determinant() < 0) {
-            U.col(2) *= -1;
-            values(2) *= -1;
+            U.col(dim - 1) *= -1;
+            values(dim - 1) *= -1;
         }
 
         if (V.determinant() < 0) {
-            V.col(2) *= -1;
-            values(2) *= -1;
+            V.col(dim - 1) *= -1;
+            values(dim - 1) *= -1;
         }
 #pragma unroll
         for (int ii = 0; ii < dim; ++ii) { sig(ii, ii) = values(ii); }
@@ -97,35 +121,259 @@ namespace nclr {
         }
     }
 
+    /**
+     * Rotation part of m, refined from a nearby rotation R (e.g. the last step's) by Newton's method instead of a
+     * full SVD. Writing R^T m = (I + [w]x) S with S symmetric, the skew part of R^T m gives the remaining turn w =
+     * (tr(S) I - S)^-1 axial(R^T m - m^T R), so the error squares every iteration and a rotation that changed little
+     * settles in one or two. When tr(S) I - S isn't positive definite (m inverted or close to degenerate, where
+     * Newton could stop at the wrong rotation) or it doesn't settle after kMaxIterations, this falls back to
+     * nclr_polar(). 2D uses the closed form.
+     */
     template<int dim>
-    inline auto cube(int res, real min, real max) {
-        const auto _2d = [&res, &min, &max]() -> std::vector<Vector<real, 2>> {
-            const auto x = Vector<real, -1>::LinSpaced(res, min, max);
-            const auto y = Vector<real, -1>::LinSpaced(res, min, max);
-
-            std::vector<Vector<real, 2>> all_pts;
-            for (auto r = 0; r < x.rows(); ++r) {
-                for (auto c = 0; c < y.rows(); ++c) { all_pts.emplace_back(x(r), y(c)); }
+    inline auto nclr_rotation(const Matrix<real, dim> &m, Matrix<real, dim> &R) -> void {
+        constexpr int kMaxIterations = 4;
+        // Turns below this are applied as the last step, the next one would be about its square
+        constexpr real kConverged = 1e-3;
+
+        Matrix<real, dim> S;
+        if constexpr (dim == 2) {
+            nclr_polar<dim>(m, R, S);
+        } else {
+            Eigen::Quaternion<real> q(R);
+            for (int ii = 0; ii < kMaxIterations; ++ii) {
+                const Matrix<real, dim> current = q.toRotationMatrix();
+                const Matrix<real, dim> A = current.transpose() * m;
+                S = (A + A.transpose()) * real(0.5);
+                const Matrix<real, dim> H = Matrix<real, dim>::Identity() * S.trace() - S;
+
+                // Leading minors of H, all positive iff it is positive definite
+                const real scale = std::max(std::abs(S.trace()), real(1e-6));
+                const real minor2 = H(0, 0) * H(1, 1) - H(0, 1) * H(1, 0);
+                if (H(0, 0) <= real(1e-3) * scale || minor2 <= real(1e-3) * scale * scale ||
+                    H.determinant() <= real(1e-3) * scale * scale * scale) {
+                    break;
+                }
+
+                const Vector<real, dim> axial(A(2, 1) - A(1, 2), A(0, 2) - A(2, 0), A(1, 0) - A(0, 1));
+                const Vector<real, dim> omega = H.inverse() * axial;
+                const real angle = omega.norm();
+                if (angle > 0) { q = q * Eigen::Quaternion<real>(Eigen::AngleAxis<real>(angle, omega / angle)); }
+                if (angle < kConverged) {
+                    R = q.normalized().toRotationMatrix();
+                    return;
+                }
+                q.normalize();
             }
-            return all_pts;
+            nclr_polar<dim>(m, R, S);
+        }
+    }
+
+    /**
+     * Calls fn(ii) for every ii in [0, n) on up to `threads` threads (0 picks one per core). Indices are handed out
+     * one at a time from a shared counter, so uneven jobs balance out.
+     */
+    template<typename Fn>
+    inline auto parallel_for(int n, int threads, Fn &&fn) -> void {
+        if (threads <= 0) { threads = std::max<int>(std::thread::hardware_concurrency(), 1); }
+        threads = std::min(threads, n);
+        if (threads <= 1) {
+            for (int ii = 0; ii < n; ++ii) { fn(ii); }
+            return;
+        }
+
+        std::atomic<int> next = 0;
+        const auto worker = [&]() -> void {
+            for (int ii = next++; ii < n; ii = next++) { fn(ii); }
         };
 
-        const auto _3d = [&res, &min, &max]() -> std::vector<Vector<real, 3>> {
-            const auto x = Vector<real, -1>::LinSpaced(res, min, max);
-            const auto y = Vector<real, -1>::LinSpaced(res, min, max);
-            const auto z = Vector<real, -1>::LinSpaced(res, min, max);
+        std::vector<std::thread> pool;
+        for (int tt = 0; tt < threads; ++tt) { pool.emplace_back(worker); }
+        for (auto &thread : pool) { thread.join(); }
+    }
+
+    // Calls fn(begin, end) over [0, n) in blocks of `block` indices, for loops too fine-grained for parallel_for
+    template<typename Fn>
+    inline auto parallel_blocks(std::size_t n, std::size_t block, int threads, Fn &&fn) -> void {
+        parallel_for((n + block - 1) / block, threads,
+                     [&](int bb) { fn(bb * block, std::min(n, (bb + 1) * block)); });
+    }
+
+    /**
+     * A fixed set of worker threads kept parked on a condition variable between jobs, so code that runs many short
+     * parallel loops (a simulation step has several) doesn't start and join threads for each one. run() hands out
+     * indices like parallel_for(), with the calling thread working alongside the pool, and returns once every
+     * index is done. One job runs at a time: run() is meant to be called from one thread, and a run() from inside a
+     * job (which would wait on itself) just loops on the calling worker.
+     */
+    class WorkerPool {
+    public:
+        // `threads` counts the calling thread, 0 picks one per core
+        explicit WorkerPool(int threads = 0) {
+            if (threads <= 0) { threads = std::max<int>(std::thread::hardware_concurrency(), 1); }
+            for (int tt = 1; tt < threads; ++tt) { workers_.emplace_back([this]() { work(); }); }
+        }
+
+        WorkerPool(const WorkerPool &) = delete;
+        auto operator=(const WorkerPool &) -> WorkerPool & = delete;
+
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for (auto &worker : workers_) { worker.join(); }
+        }
+
+        // Threads a job runs on, the caller included
+        auto size() const -> int { return int(workers_.size()) + 1; }
+
+        template<typename Fn>
+        auto run(int n, Fn &&fn) -> void {
+            if (workers_.empty() || n <= 1 || in_job()) {
+                for (int ii = 0; ii < n; ++ii) { fn(ii); }
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                job_ = [](void *context, int ii) { (*static_cast<std::remove_reference_t<Fn> *>(context))(ii); };
+                context_ = const_cast<void *>(static_cast<const void *>(&fn));
+                n_ = n;
+                next_ = 0;
+                busy_ = int(workers_.size());
+                ++generation_;
+            }
+            wake_.notify_all();
+
+            in_job() = true;
+            drain();
+            in_job() = false;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this]() { return busy_ == 0; });
+        }
+
+    private:
+        std::vector<std::thread> workers_;
+
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+        bool stop_ = false;
+
+        // The current job, replaced under the mutex when generation_ moves on
+        void (*job_)(void *, int) = nullptr;
+        void *context_ = nullptr;
+        int n_ = 0;
+        std::atomic<int> next_ = 0;
+        int busy_ = 0;
+        std::size_t generation_ = 0;
+
+        static auto in_job() -> bool & {
+            thread_local bool in_job = false;
+            return in_job;
+        }
+
+        auto drain() -> void {
+            for (int ii = next_++; ii < n_; ii = next_++) { job_(context_, ii); }
+        }
 
-            std::vector<Vector<real, 3>> all_pts;
-            for (int l = 0; l < x.rows(); ++l) {
-                for (int r = 0; r < y.rows(); ++r) {
-                    for (int c = 0; c < z.rows(); ++c) { all_pts.emplace_back(x(l), y(r), z(c)); }
+        auto work() -> void {
+            in_job() = true;
+            std::size_t seen = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+                    if (stop_) { return; }
+                    seen = generation_;
                 }
+                drain();
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    --busy_;
+                }
+                done_.notify_one();
             }
-            return all_pts;
-        };
+        }
+    };
+
+    // parallel_for() on a WorkerPool's threads
+    template<typename Fn>
+    inline auto parallel_for(int n, WorkerPool &pool, Fn &&fn) -> void {
+        pool.run(n, fn);
+    }
 
-        if constexpr (dim == 2) { return _2d(); }
-        if constexpr (dim == 3) { return _3d(); }
+    // parallel_blocks() on a WorkerPool's threads
+    template<typename Fn>
+    inline auto parallel_blocks(std::size_t n, std::size_t block, WorkerPool &pool, Fn &&fn) -> void {
+        pool.run(int((n + block - 1) / block), [&](int bb) { fn(bb * block, std::min(n, (bb + 1) * block)); });
+    }
+
+    /**
+     * Lock-free triple buffer between one writer and one reader thread. The writer fills back() and publish()es
+     * it, the reader's read() picks up the newest published slot. Neither side ever waits, and the slot read()
+     * returned stays untouched until the reader calls read() again.
+     */
+    template<typename T>
+    class TripleBuffer {
+    public:
+        auto back() -> T & { return slots_[back_]; }
+
+        auto publish() -> void {
+            // The filled back slot becomes the fresh middle, the old middle is the writer's next back slot
+            back_ = middle_.exchange(back_ | kFresh, std::memory_order_acq_rel) & kIndex;
+        }
+
+        // Newest published value, the previous one if nothing new was published since, or nullptr before the first
+        auto read() -> const T * {
+            if (middle_.load(std::memory_order_relaxed) & kFresh) {
+                front_ = middle_.exchange(front_, std::memory_order_acq_rel) & kIndex;
+                has_value_ = true;
+            }
+            return has_value_ ? &slots_[front_] : nullptr;
+        }
+
+    private:
+        constexpr static uint8_t kIndex = 3;
+        constexpr static uint8_t kFresh = 4;
+
+        std::array<T, 3> slots_;
+
+        // Writer side
+        uint8_t back_ = 0;
+
+        // Shared slot index, with kFresh set while the reader has not picked it up
+        std::atomic<uint8_t> middle_ = 1;
+
+        // Reader side
+        uint8_t front_ = 2;
+        bool has_value_ = false;
+    };
+
+    // res^dim lattice points filling [min, max] along every axis, written in parallel on `threads` threads
+    template<int dim>
+    inline auto cube(int res, real min, real max, int threads = 0) -> std::vector<Vector<real, dim>> {
+        constexpr std::size_t kBlockSize = 4096;
+
+        const real spacing = res > 1 ? (max - min) / (res - 1) : 0;
+
+        std::size_t count = 1;
+        for (int dd = 0; dd < dim; ++dd) { count *= res; }
+
+        // Last axis fastest, each point is computed straight from its flat index
+        std::vector<Vector<real, dim>> all_pts(count);
+        parallel_blocks(count, kBlockSize, threads, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t ii = begin; ii < end; ++ii) {
+                std::size_t rest = ii;
+                for (int dd = dim - 1; dd >= 0; --dd) {
+                    all_pts[ii](dd) = min + (rest % res) * spacing;
+                    rest /= res;
+                }
+            }
+        });
+        return all_pts;
     }
 
     inline auto gyroid(real k, real t, const Vector<real, 3> &pos) -> real {
@@ -140,10 +388,9 @@ namespace nclr {
 
     template<int dim>
     inline auto sample(const Vector<real, dim> &center) -> std::vector<Vector<real, dim>> {
-        std::vector<Vector<real, dim>> particles;
-        for (int ii = 0; ii < 1000; ++ii) {
-            particles.push_back((randvec<dim>() * 2.0 - constvec<dim>(1)) * 0.08 + center);
-        }
+        std::vector<Vector<real, dim>> particles(1000);
+        for (auto &particle : particles) { particle = (randvec<dim>() * 2.0 - constvec<dim>(1)) * 0.08 + center; }
+        return particles;
     }
 
     inline real to_radians(real degrees) {
@@ -0,0 +1,367 @@
+#pragma once
+
+#include "nclr_seed.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace nclr {
+    struct TriangleMesh {
+        std::vector<Vector<real, 3>> vertices;
+        std::vector<Vector<int, 3>> faces;
+
+        auto transform(real scale, const Vector<real, 3> &translate) -> void {
+            for (auto &vertex : vertices) { vertex = vertex * scale + translate; }
+        }
+    };
+
+    namespace detail {
+        // Splits a polygon into a triangle fan
+        inline auto add_polygon(TriangleMesh &mesh, const std::vector<int> &polygon) -> void {
+            for (int ii = 1; ii + 1 < polygon.size(); ++ii) {
+                mesh.faces.emplace_back(polygon.at(0), polygon.at(ii), polygon.at(ii + 1));
+            }
+        }
+
+        inline auto ply_type_size(const std::string &type) -> int {
+            if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") { return 1; }
+            if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") { return 2; }
+            if (type == "int" || type == "uint" || type == "float" || type == "int32" || type == "uint32" ||
+                type == "float32") {
+                return 4;
+            }
+            if (type == "double" || type == "float64") { return 8; }
+            throw std::runtime_error("unknown PLY type \"" + type + "\"");
+        }
+
+        // Reads one little endian binary PLY scalar as a double
+        inline auto read_ply_scalar(std::istream &is, const std::string &type) -> double {
+            char bytes[8] = {};
+            is.read(bytes, ply_type_size(type));
+            if (type == "char" || type == "int8") { return *reinterpret_cast<int8_t *>(bytes); }
+            if (type == "uchar" || type == "uint8") { return *reinterpret_cast<uint8_t *>(bytes); }
+            if (type == "short" || type == "int16") { return *reinterpret_cast<int16_t *>(bytes); }
+            if (type == "ushort" || type == "uint16") { return *reinterpret_cast<uint16_t *>(bytes); }
+            if (type == "int" || type == "int32") { return *reinterpret_cast<int32_t *>(bytes); }
+            if (type == "uint" || type == "uint32") { return *reinterpret_cast<uint32_t *>(bytes); }
+            if (type == "float" || type == "float32") { return *reinterpret_cast<float *>(bytes); }
+            return *reinterpret_cast<double *>(bytes);
+        }
+    }// namespace detail
+
+    // Reads the vertices and faces of a Wavefront OBJ, polygons are triangulated as fans
+    inline auto load_obj(const std::string &filename) -> TriangleMesh {
+        std::ifstream ifs(filename);
+        if (!ifs.is_open()) { throw std::runtime_error("could not open " + filename); }
+
+        TriangleMesh mesh;
+        std::string line;
+        while (std::getline(ifs, line)) {
+            std::istringstream iss(line);
+            std::string tag;
+            iss >> tag;
+            if (tag == "v") {
+                Vector<real, 3> vertex;
+                iss >> vertex(0) >> vertex(1) >> vertex(2);
+                mesh.vertices.push_back(vertex);
+            } else if (tag == "f") {
+                std::vector<int> polygon;
+                std::string corner;
+                while (iss >> corner) {
+                    // v, v/vt, v//vn or v/vt/vn, negative indices count back from the last vertex
+                    const int index = std::stoi(corner.substr(0, corner.find('/')));
+                    polygon.push_back(index < 0 ? int(mesh.vertices.size()) + index : index - 1);
+                }
+                detail::add_polygon(mesh, polygon);
+            }
+        }
+        return mesh;
+    }
+
+    // Reads the vertices and faces of an ASCII or binary little endian PLY
+    inline auto load_ply(const std::string &filename) -> TriangleMesh {
+        std::ifstream ifs(filename, std::ios::binary);
+        if (!ifs.is_open()) { throw std::runtime_error("could not open " + filename); }
+
+        struct Element {
+            std::string name;
+            std::size_t count;
+            // (type, name), list properties store "list <count type> <index type>" as the type
+            std::vector<std::pair<std::string, std::string>> properties;
+        };
+
+        std::vector<Element> elements;
+        bool binary = false;
+        std::string line;
+        while (std::getline(ifs, line)) {
+            if (!line.empty() && line.back() == '\r') { line.pop_back(); }
+            std::istringstream iss(line);
+            std::string tag;
+            iss >> tag;
+            if (tag == "format") {
+                std::string format;
+                iss >> format;
+                if (format == "binary_big_endian") { throw std::runtime_error("big endian PLY is not supported"); }
+                binary = format == "binary_little_endian";
+            } else if (tag == "element") {
+                Element element;
+                iss >> element.name >> element.count;
+                elements.push_back(element);
+            } else if (tag == "property" && !elements.empty()) {
+                std::string type, name;
+                iss >> type;
+                if (type == "list") {
+                    std::string count_type, index_type;
+                    iss >> count_type >> index_type;
+                    type = "list " + count_type + " " + index_type;
+                }
+                iss >> name;
+                elements.back().properties.emplace_back(type, name);
+            } else if (tag == "end_header") {
+                break;
+            }
+        }
+
+        TriangleMesh mesh;
+        for (const auto &element : elements) {
+            for (std::size_t ii = 0; ii < element.count; ++ii) {
+                std::istringstream ascii;
+                if (!binary) {
+                    std::getline(ifs, line);
+                    ascii.str(line);
+                }
+                std::istream &is = binary ? static_cast<std::istream &>(ifs) : ascii;
+
+                Vector<real, 3> vertex = Vector<real, 3>::Zero();
+                for (const auto &[type, name] : element.properties) {
+                    if (type.rfind("list", 0) == 0) {
+                        std::istringstream list_type(type.substr(5));
+                        std::string count_type, index_type;
+                        list_type >> count_type >> index_type;
+
+                        double count;
+                        if (binary) {
+                            count = detail::read_ply_scalar(is, count_type);
+                        } else {
+                            is >> count;
+                        }
+                        std::vector<int> polygon(static_cast<std::size_t>(count));
+                        for (auto &index : polygon) {
+                            if (binary) {
+                                index = detail::read_ply_scalar(is, index_type);
+                            } else {
+                                is >> index;
+                            }
+                        }
+                        if (element.name == "face") { detail::add_polygon(mesh, polygon); }
+                    } else {
+                        double value;
+                        if (binary) {
+                            value = detail::read_ply_scalar(is, type);
+                        } else {
+                            is >> value;
+                        }
+                        if (name == "x") { vertex(0) = value; }
+                        if (name == "y") { vertex(1) = value; }
+                        if (name == "z") { vertex(2) = value; }
+                    }
+                }
+                if (!is) { throw std::runtime_error("truncated PLY " + filename); }
+                if (element.name == "vertex") { mesh.vertices.push_back(vertex); }
+            }
+        }
+        return mesh;
+    }
+
+    // Picks the loader from the file extension
+    inline auto load_mesh(const std::string &filename) -> TriangleMesh {
+        const auto dot = filename.rfind('.');
+        const std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+        TriangleMesh mesh;
+        if (extension == "obj" || extension == "OBJ") {
+            mesh = load_obj(filename);
+        } else if (extension == "ply" || extension == "PLY") {
+            mesh = load_ply(filename);
+        } else {
+            throw std::runtime_error("unknown mesh format " + filename + " (expected .obj or .ply)");
+        }
+
+        for (const auto &face : mesh.faces) {
+            if ((face.array() < 0).any() || (face.array() >= int(mesh.vertices.size())).any()) {
+                throw std::runtime_error("face index out of range in " + filename);
+            }
+        }
+        return mesh;
+    }
+
+    // Writes a Wavefront OBJ with vertices and triangles only
+    inline auto save_obj(const TriangleMesh &mesh, const std::string &filename) -> void {
+        std::ofstream ofs(filename);
+        if (!ofs.is_open()) { throw std::runtime_error("could not open " + filename); }
+        for (const auto &vertex : mesh.vertices) {
+            ofs << "v " << vertex(0) << " " << vertex(1) << " " << vertex(2) << "\n";
+        }
+        for (const auto &face : mesh.faces) {
+            ofs << "f " << face(0) + 1 << " " << face(1) + 1 << " " << face(2) + 1 << "\n";
+        }
+    }
+
+    // Writes a binary little endian PLY with float vertices and int triangle indices (assumes a little endian host)
+    inline auto save_ply(const TriangleMesh &mesh, const std::string &filename) -> void {
+        std::ofstream ofs(filename, std::ios::binary);
+        if (!ofs.is_open()) { throw std::runtime_error("could not open " + filename); }
+        ofs << "ply\nformat binary_little_endian 1.0\n"
+            << "element vertex " << mesh.vertices.size() << "\n"
+            << "property float x\nproperty float y\nproperty float z\n"
+            << "element face " << mesh.faces.size() << "\n"
+            << "property list uchar int vertex_indices\nend_header\n";
+
+        std::vector<char> buffer(mesh.vertices.size() * 3 * sizeof(float));
+        for (std::size_t vv = 0; vv < mesh.vertices.size(); ++vv) {
+            const float vertex[3] = {float(mesh.vertices[vv](0)), float(mesh.vertices[vv](1)),
+                                     float(mesh.vertices[vv](2))};
+            std::memcpy(&buffer[vv * sizeof(vertex)], vertex, sizeof(vertex));
+        }
+        ofs.write(buffer.data(), buffer.size());
+
+        constexpr std::size_t kFaceBytes = 1 + 3 * sizeof(int32_t);
+        buffer.resize(mesh.faces.size() * kFaceBytes);
+        for (std::size_t ff = 0; ff < mesh.faces.size(); ++ff) {
+            const int32_t face[3] = {mesh.faces[ff](0), mesh.faces[ff](1), mesh.faces[ff](2)};
+            buffer[ff * kFaceBytes] = 3;
+            std::memcpy(&buffer[ff * kFaceBytes + 1], face, sizeof(face));
+        }
+        ofs.write(buffer.data(), buffer.size());
+    }
+
+    // Picks the writer from the file extension
+    inline auto save_mesh(const TriangleMesh &mesh, const std::string &filename) -> void {
+        const auto dot = filename.rfind('.');
+        const std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+        if (extension == "obj" || extension == "OBJ") {
+            save_obj(mesh, filename);
+        } else if (extension == "ply" || extension == "PLY") {
+            save_ply(mesh, filename);
+        } else {
+            throw std::runtime_error("unknown mesh format " + filename + " (expected .obj or .ply)");
+        }
+    }
+
+    /**
+     * Inside/outside occupancy of a closed mesh on a grid of cubic voxels. Every (x, y) column casts a ray along z
+     * through the voxel centers and fills the spans between pairs of crossings, so each column is independent and
+     * the columns are filled in parallel. Meant to be passed to seed() like an Sdf: distance() is negative in
+     * occupied voxels and positive everywhere else.
+     */
+    class VoxelizedMesh {
+    public:
+        VoxelizedMesh(const TriangleMesh &mesh, real spacing, int threads = 0) : spacing_(spacing) {
+            Vector<real, 3> hi;
+            lo_ = hi = mesh.vertices.empty() ? constvec<3>(0) : mesh.vertices.front();
+            for (const auto &vertex : mesh.vertices) {
+                lo_ = lo_.cwiseMin(vertex);
+                hi = hi.cwiseMax(vertex);
+            }
+            for (int dd = 0; dd < 3; ++dd) { n_(dd) = std::max(int(std::ceil((hi(dd) - lo_(dd)) / spacing)), 1); }
+            occupancy_.assign(std::size_t(n_(0)) * n_(1) * n_(2), 0);
+
+            // Bucket every triangle into the columns its xy bounds overlap
+            std::vector<std::vector<int>> columns(std::size_t(n_(0)) * n_(1));
+            for (int ff = 0; ff < mesh.faces.size(); ++ff) {
+                Vector<real, 3> tri_lo = mesh.vertices.at(mesh.faces.at(ff)(0)), tri_hi = tri_lo;
+                for (int vv = 1; vv < 3; ++vv) {
+                    tri_lo = tri_lo.cwiseMin(mesh.vertices.at(mesh.faces.at(ff)(vv)));
+                    tri_hi = tri_hi.cwiseMax(mesh.vertices.at(mesh.faces.at(ff)(vv)));
+                }
+                const int i0 = std::max(int(std::floor((tri_lo(0) - lo_(0)) / spacing - 0.5)), 0);
+                const int i1 = std::min(int(std::ceil((tri_hi(0) - lo_(0)) / spacing - 0.5)), n_(0) - 1);
+                const int j0 = std::max(int(std::floor((tri_lo(1) - lo_(1)) / spacing - 0.5)), 0);
+                const int j1 = std::min(int(std::ceil((tri_hi(1) - lo_(1)) / spacing - 0.5)), n_(1) - 1);
+                for (int ii = i0; ii <= i1; ++ii) {
+                    for (int jj = j0; jj <= j1; ++jj) { columns.at(std::size_t(ii) * n_(1) + jj).push_back(ff); }
+                }
+            }
+
+            parallel_for(n_(0), threads, [&](int ii) {
+                std::vector<real> hits;
+                for (int jj = 0; jj < n_(1); ++jj) {
+                    // Nudge the ray off the voxel center so it never runs exactly through a shared edge or vertex
+                    const real x = lo_(0) + (ii + 0.5 + 1e-4) * spacing;
+                    const real y = lo_(1) + (jj + 0.5 + 1.7e-4) * spacing;
+
+                    hits.clear();
+                    for (const int ff : columns.at(std::size_t(ii) * n_(1) + jj)) {
+                        real z;
+                        if (ray_hit(mesh, mesh.faces.at(ff), x, y, z)) { hits.push_back(z); }
+                    }
+                    std::sort(hits.begin(), hits.end());
+
+                    // Voxels between crossing 2k and 2k + 1 are inside
+                    for (int hh = 0; hh + 1 < hits.size(); hh += 2) {
+                        const int k0 = std::max(int(std::ceil((hits.at(hh) - lo_(2)) / spacing - 0.5)), 0);
+                        const int k1 = std::min(int(std::floor((hits.at(hh + 1) - lo_(2)) / spacing - 0.5)), n_(2) - 1);
+                        for (int kk = k0; kk <= k1; ++kk) { occupancy_.at(index(ii, jj, kk)) = 1; }
+                    }
+                }
+            });
+        }
+
+        auto distance(const Vector<real, 3> &x) const -> real {
+            const Vector<int, 3> voxel = ((x - lo_) / spacing_).array().floor().template cast<int>();
+            if ((voxel.array() < 0).any() || (voxel.array() >= n_.array()).any()) { return spacing_; }
+            return occupancy_.at(index(voxel(0), voxel(1), voxel(2))) ? -spacing_ : spacing_;
+        }
+
+        auto bounds(Vector<real, 3> &lo, Vector<real, 3> &hi) const -> void {
+            lo = lo_;
+            hi = lo_ + n_.template cast<real>() * spacing_;
+        }
+
+    private:
+        real spacing_;
+        Vector<real, 3> lo_;
+        Vector<int, 3> n_;
+        std::vector<uint8_t> occupancy_;
+
+        auto index(int ii, int jj, int kk) const -> std::size_t {
+            return (std::size_t(ii) * n_(1) + jj) * n_(2) + kk;
+        }
+
+        // Crossing of the vertical ray through (x, y) with a triangle, z is only set on a hit
+        static auto ray_hit(const TriangleMesh &mesh, const Vector<int, 3> &face, real x, real y, real &z) -> bool {
+            const Vector<real, 3> &a = mesh.vertices.at(face(0));
+            const Vector<real, 3> &b = mesh.vertices.at(face(1));
+            const Vector<real, 3> &c = mesh.vertices.at(face(2));
+
+            // Barycentric coordinates of (x, y) in the xy projection of the triangle
+            const real area = (b(0) - a(0)) * (c(1) - a(1)) - (c(0) - a(0)) * (b(1) - a(1));
+            if (area == 0) { return false; }
+            const real u = ((b(0) - x) * (c(1) - y) - (c(0) - x) * (b(1) - y)) / area;
+            const real v = ((c(0) - x) * (a(1) - y) - (a(0) - x) * (c(1) - y)) / area;
+            const real w = 1 - u - v;
+            if (u < 0 || v < 0 || w < 0) { return false; }
+
+            z = u * a(2) + v * b(2) + w * c(2);
+            return true;
+        }
+    };
+
+    /**
+     * Fills a closed triangle mesh with particles. The mesh is voxelized at about the spacing between samples
+     * (dx / round(ppc^(1/3))), seeded like any other shape and returned in Morton order of the grid cells of size
+     * dx, so the first steps already have good locality.
+     */
+    inline auto seed_mesh(const TriangleMesh &mesh, SeedPattern pattern, real dx, int ppc = 1,
+                          uint32_t seed_value = 0, int threads = 0) -> std::vector<Vector<real, 3>> {
+        const int per_axis = std::max(int(std::round(std::cbrt(real(ppc)))), 1);
+        const VoxelizedMesh voxels(mesh, dx / per_axis, threads);
+        auto positions = seed<3>(voxels, pattern, dx, ppc, seed_value, threads);
+        morton_order<3>(positions, dx, threads);
+        return positions;
+    }
+}// namespace nclr
@@ -0,0 +1,424 @@
+#pragma once
+
+#include "nclr.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nclr {
+    // 8-bit RGBA pixels, row major from the top left corner
+    struct Image {
+        int width = 0;
+        int height = 0;
+        std::vector<uint8_t> rgba;
+
+        auto set(int px, int py, int color) -> void {
+            uint8_t *pixel = &rgba[(std::size_t(py) * width + px) * 4];
+            pixel[0] = (color >> 16) & 0xFF;
+            pixel[1] = (color >> 8) & 0xFF;
+            pixel[2] = color & 0xFF;
+            pixel[3] = 0xFF;
+        }
+    };
+
+    // Binary PPM (P6), readable by most viewers and by ffmpeg for preview videos. Alpha is dropped.
+    inline auto save_ppm(const Image &image, const std::string &filename) -> void {
+        std::ofstream ofs(filename, std::ios::binary);
+        if (!ofs.is_open()) { throw std::runtime_error("could not open " + filename); }
+        ofs << "P6\n" << image.width << " " << image.height << "\n255\n";
+        std::vector<char> row(std::size_t(image.width) * 3);
+        for (int py = 0; py < image.height; ++py) {
+            for (int px = 0; px < image.width; ++px) {
+                const std::size_t pixel = (std::size_t(py) * image.width + px) * 4;
+                for (int ch = 0; ch < 3; ++ch) { row[px * 3 + ch] = image.rgba[pixel + ch]; }
+            }
+            ofs.write(row.data(), row.size());
+        }
+    }
+
+    enum class Projection {
+        kOrthographic = 0,
+        kPerspective,
+    };
+
+    struct Camera {
+        Projection projection = Projection::kOrthographic;
+        Vector<real, 3> eye = Vector<real, 3>(0.5, 0.5, 2.5);
+        Vector<real, 3> target = constvec<3>(0.5);
+        Vector<real, 3> up = Vector<real, 3>(0, 1, 0);
+
+        // Half of the visible height at the target (orthographic), or the vertical field of view in degrees
+        real half_height = 0.75;
+        real fov = 40;
+
+        /**
+         * Camera circling `target` at `distance`, turned by `yaw` degrees around y and tilted down by `pitch`
+         * degrees. The default angles are the ones pt_3d_to_2d() hardcodes.
+         */
+        static auto orbit(const Vector<real, 3> &target, real distance, real yaw = 28, real pitch = 32,
+                          Projection projection = Projection::kOrthographic) -> Camera {
+            Camera camera;
+            camera.projection = projection;
+            camera.target = target;
+            const real y = to_radians(yaw), p = to_radians(pitch);
+            camera.eye = target + distance * Vector<real, 3>(std::sin(y) * std::cos(p), std::sin(p),
+                                                             std::cos(y) * std::cos(p));
+            return camera;
+        }
+    };
+
+    /**
+     * Offscreen splatting renderer that draws every particle as a filled disc. Particles are projected in parallel
+     * blocks, binned into square screen tiles (a stable counting sort, so in 2D later particles still draw over
+     * earlier ones), and the tiles are then rasterized in parallel, each by one thread, with no shared writes. In 3D
+     * the nearest particle wins through a per-tile depth buffer.
+     */
+    template<int dim>
+    class SplatRenderer {
+    public:
+        constexpr static int kTileSize = 32;
+        constexpr static std::size_t kBlockSize = 1 << 16;
+
+        SplatRenderer(int width, int height, int threads = 0) : threads_(threads) {
+            image_.width = width;
+            image_.height = height;
+            image_.rgba.resize(std::size_t(width) * height * 4);
+            tiles_x_ = (width + kTileSize - 1) / kTileSize;
+            tiles_y_ = (height + kTileSize - 1) / kTileSize;
+        }
+
+        // 3D only, 2D maps [0, extent]^2 onto the whole image
+        auto set_camera(const Camera &camera) -> void { camera_ = camera; }
+        auto set_extent(real extent) -> void { extent_ = extent; }
+        auto set_background(int color) -> void { background_ = color; }
+
+        // Disc radius in pixels, in perspective this is the radius at the target's distance
+        auto set_radius(real radius) -> void { radius_ = radius; }
+
+        auto render(const std::vector<Vector<real, dim>> &x, const std::vector<int> &c) -> const Image & {
+            project(x);
+            bin();
+            rasterize(c);
+            return image_;
+        }
+
+        auto render(const Snapshot<dim> &snapshot) -> const Image & { return render(snapshot.x, snapshot.c); }
+
+        auto render(const std::vector<Particle<dim>> &particles) -> const Image & {
+            positions_.resize(particles.size());
+            colors_.resize(particles.size());
+            parallel_blocks(particles.size(), kBlockSize, threads_, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t pp = begin; pp < end; ++pp) {
+                    positions_[pp] = particles[pp].x;
+                    colors_[pp] = particles[pp].c;
+                }
+            });
+            return render(positions_, colors_);
+        }
+
+        auto image() const -> const Image & { return image_; }
+
+    private:
+        // A projected particle, radius <= 0 marks one that is culled
+        struct Splat {
+            real px;
+            real py;
+            real depth;
+            real radius;
+        };
+
+        int threads_;
+        Camera camera_;
+        real extent_ = 1.0;
+        real radius_ = 1.5;
+        int background_ = 0x112F41;
+
+        int tiles_x_;
+        int tiles_y_;
+        Image image_;
+
+        std::vector<Splat> splats_;
+
+        // Particle indices grouped by tile, tile t owns [tile_offsets_[t], tile_offsets_[t + 1])
+        std::vector<std::size_t> tile_offsets_;
+        std::vector<uint32_t> binned_;
+
+        // Scratch for render(particles)
+        std::vector<Vector<real, dim>> positions_;
+        std::vector<int> colors_;
+
+        auto project(const std::vector<Vector<real, dim>> &x) -> void {
+            splats_.resize(x.size());
+            const real half_w = real(0.5) * image_.width, half_h = real(0.5) * image_.height;
+
+            // Camera basis, only used in 3D
+            const Vector<real, 3> forward = (camera_.target - camera_.eye).normalized();
+            const Vector<real, 3> right = forward.cross(camera_.up).normalized();
+            const Vector<real, 3> up = right.cross(forward);
+            const real focus = (camera_.target - camera_.eye).norm();
+            const real tan_half_fov = std::tan(to_radians(camera_.fov) / 2);
+
+            parallel_blocks(x.size(), kBlockSize, threads_, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t pp = begin; pp < end; ++pp) {
+                    auto &splat = splats_[pp];
+                    splat.radius = radius_;
+                    if constexpr (dim == 2) {
+                        splat.px = x[pp](0) / extent_ * image_.width;
+                        splat.py = (1 - x[pp](1) / extent_) * image_.height;
+                        splat.depth = 0;
+                    } else {
+                        const Vector<real, 3> d = x[pp] - camera_.eye;
+                        const real depth = d.dot(forward);
+                        real scale = 1 / camera_.half_height;
+                        if (camera_.projection == Projection::kPerspective) {
+                            scale = depth > 0 ? 1 / (depth * tan_half_fov) : 0;
+                            splat.radius = depth > 0 ? radius_ * focus / depth : 0;
+                        }
+                        // Normalized device coordinates span the image height, x keeps the same scale
+                        splat.px = half_w + d.dot(right) * scale * half_h;
+                        splat.py = half_h - d.dot(up) * scale * half_h;
+                        splat.depth = depth;
+                    }
+
+                    // Cull what cannot touch the image (also catches NaN)
+                    if (!(splat.px + splat.radius >= 0 && splat.px - splat.radius < image_.width &&
+                          splat.py + splat.radius >= 0 && splat.py - splat.radius < image_.height)) {
+                        splat.radius = 0;
+                    }
+                }
+            });
+        }
+
+        // Visits every tile a splat overlaps
+        template<typename Fn>
+        auto for_each_tile(const Splat &splat, Fn &&fn) const -> void {
+            const int tx0 = std::max(int(std::floor((splat.px - splat.radius) / kTileSize)), 0);
+            const int tx1 = std::min(int(std::floor((splat.px + splat.radius) / kTileSize)), tiles_x_ - 1);
+            const int ty0 = std::max(int(std::floor((splat.py - splat.radius) / kTileSize)), 0);
+            const int ty1 = std::min(int(std::floor((splat.py + splat.radius) / kTileSize)), tiles_y_ - 1);
+            for (int ty = ty0; ty <= ty1; ++ty) {
+                for (int tx = tx0; tx <= tx1; ++tx) { fn(ty * tiles_x_ + tx); }
+            }
+        }
+
+        /**
+         * Counting sort of splat references by tile: every block counts its references per tile, a scan over
+         * (tile, block) gives each block its write position inside each tile, and the blocks then scatter in
+         * parallel. Within a tile the references stay in particle order.
+         */
+        auto bin() -> void {
+            const std::size_t tiles = std::size_t(tiles_x_) * tiles_y_;
+            const std::size_t blocks = (splats_.size() + kBlockSize - 1) / kBlockSize;
+            std::vector<std::size_t> counts(blocks * tiles, 0);
+
+            parallel_blocks(splats_.size(), kBlockSize, threads_, [&](std::size_t begin, std::size_t end) {
+                std::size_t *block_counts = &counts[begin / kBlockSize * tiles];
+                for (std::size_t pp = begin; pp < end; ++pp) {
+                    if (splats_[pp].radius > 0) {
+                        for_each_tile(splats_[pp], [&](int tile) { ++block_counts[tile]; });
+                    }
+                }
+            });
+
+            tile_offsets_.assign(tiles + 1, 0);
+            std::size_t total = 0;
+            for (std::size_t tt = 0; tt < tiles; ++tt) {
+                tile_offsets_[tt] = total;
+                for (std::size_t bb = 0; bb < blocks; ++bb) {
+                    const std::size_t count = counts[bb * tiles + tt];
+                    counts[bb * tiles + tt] = total;
+                    total += count;
+                }
+            }
+            tile_offsets_[tiles] = total;
+
+            binned_.resize(total);
+            parallel_blocks(splats_.size(), kBlockSize, threads_, [&](std::size_t begin, std::size_t end) {
+                std::size_t *cursor = &counts[begin / kBlockSize * tiles];
+                for (std::size_t pp = begin; pp < end; ++pp) {
+                    if (splats_[pp].radius > 0) {
+                        for_each_tile(splats_[pp], [&](int tile) { binned_[cursor[tile]++] = pp; });
+                    }
+                }
+            });
+        }
+
+        auto rasterize(const std::vector<int> &c) -> void {
+            parallel_for(tiles_x_ * tiles_y_, threads_, [&](int tile) {
+                const int x0 = (tile % tiles_x_) * kTileSize, y0 = (tile / tiles_x_) * kTileSize;
+                const int x1 = std::min(x0 + kTileSize, image_.width), y1 = std::min(y0 + kTileSize, image_.height);
+
+                real depth[kTileSize * kTileSize];
+                std::fill(depth, depth + kTileSize * kTileSize, std::numeric_limits<real>::max());
+                for (int py = y0; py < y1; ++py) {
+                    for (int px = x0; px < x1; ++px) { image_.set(px, py, background_); }
+                }
+
+                for (std::size_t bb = tile_offsets_[tile]; bb < tile_offsets_[tile + 1]; ++bb) {
+                    const std::size_t pp = binned_[bb];
+                    const Splat &splat = splats_[pp];
+                    const int color = c.empty() ? 0xED553B : c[pp];
+
+                    // Pixel centers inside the disc, clipped to this tile
+                    const int sx0 = std::max(int(std::ceil(splat.px - splat.radius - 0.5)), x0);
+                    const int sx1 = std::min(int(std::floor(splat.px + splat.radius - 0.5)), x1 - 1);
+                    const int sy0 = std::max(int(std::ceil(splat.py - splat.radius - 0.5)), y0);
+                    const int sy1 = std::min(int(std::floor(splat.py + splat.radius - 0.5)), y1 - 1);
+                    const real r2 = splat.radius * splat.radius;
+                    for (int py = sy0; py <= sy1; ++py) {
+                        const real dy = py + real(0.5) - splat.py;
+                        for (int px = sx0; px <= sx1; ++px) {
+                            const real dx = px + real(0.5) - splat.px;
+                            if (dx * dx + dy * dy > r2) { continue; }
+                            real &z = depth[(py - y0) * kTileSize + (px - x0)];
+                            // In 2D every depth is 0, so later particles win like canvas.circle()
+                            if (splat.depth > z) { continue; }
+                            z = splat.depth;
+                            image_.set(px, py, color);
+                        }
+                    }
+                }
+            });
+        }
+    };
+
+    enum class GridField {
+        kMass = 0,
+        kVelocity,
+        kJp,
+    };
+
+    // Piecewise linear viridis, t is clamped to [0, 1]
+    inline auto colormap(real t) -> int {
+        constexpr int kStops[] = {0x440154, 0x3B528B, 0x21918C, 0x5EC962, 0xFDE725};
+        constexpr int kSegments = sizeof(kStops) / sizeof(kStops[0]) - 1;
+        t = std::isfinite(t) ? std::clamp(t, real(0), real(1)) * kSegments : 0;
+        const int segment = std::min(int(t), kSegments - 1);
+        const real f = t - segment;
+        int color = 0;
+        for (int shift = 16; shift >= 0; shift -= 8) {
+            const real lo = (kStops[segment] >> shift) & 0xFF, hi = (kStops[segment + 1] >> shift) & 0xFF;
+            color |= int(lo + (hi - lo) * f + real(0.5)) << shift;
+        }
+        return color;
+    }
+
+    struct FieldImageSettings {
+        GridField field = GridField::kMass;
+
+        // 3D draws the slice of nodes normal to `axis` closest to `slice` (a fraction of the domain)
+        int axis = 2;
+        real slice = 0.5;
+
+        // Pixels per grid node along each side
+        int scale = 4;
+
+        // Values map onto [0, max], or [min, max] for Jp, a max of 0 scales to the frame's own range
+        real max = 0;
+        real min = 0;
+
+        // Nodes without particles when drawing Jp
+        int background = 0x112F41;
+    };
+
+    /**
+     * Colormapped image of a grid quantity for monitoring runs: node mass, node speed, or the average Jp of the
+     * particles nearest each node. 2D draws the whole grid with x to the right and y up. 3D draws one slice, with
+     * the lower of the two remaining axes to the right and the higher one up: y and z for axis 0, x and z for axis
+     * 1, x and y for axis 2. Mass and speed are read straight off the last step's grid, Jp is binned from the
+     * particles by contiguous chunks into per-chunk buffers that are summed afterwards, and the image rows are
+     * filled in parallel.
+     */
+    template<int dim>
+    inline auto render_field(const MPMSimulation<dim> &sim, const FieldImageSettings &settings, int threads = 0)
+            -> Image {
+        const int nodes = sim.res() + 1;
+        const int u_axis = dim == 2 ? 0 : settings.axis == 0 ? 1 : 0;
+        const int v_axis = dim == 2 ? 1 : settings.axis == 2 ? 1 : 2;
+        const int layer = std::clamp(int(std::lround(settings.slice * sim.res())), 0, sim.res());
+
+        // Flat index of node (u, v) in the slice
+        const auto node_index = [&](int u, int v) -> std::size_t {
+            Vector<int, dim> node;
+            if constexpr (dim == 3) { node(settings.axis) = layer; }
+            node(u_axis) = u;
+            node(v_axis) = v;
+            std::size_t index = 0;
+            for (int dd = 0; dd < dim; ++dd) { index = index * nodes + node(dd); }
+            return index;
+        };
+
+        // Values per slice node, covered is false where Jp has no particles
+        std::vector<real> values(std::size_t(nodes) * nodes, 0);
+        std::vector<char> covered(values.size(), 1);
+        if (settings.field == GridField::kJp) {
+            const auto &particles = sim.particles();
+            const int chunks = std::max<int>(threads > 0 ? threads : std::thread::hardware_concurrency(), 1);
+            std::vector<std::vector<real>> sums(chunks), counts(chunks);
+            parallel_for(chunks, threads, [&](int chunk) {
+                sums[chunk].assign(values.size(), 0);
+                counts[chunk].assign(values.size(), 0);
+                const std::size_t begin = particles.size() * chunk / chunks;
+                const std::size_t end = particles.size() * (chunk + 1) / chunks;
+                for (std::size_t pp = begin; pp < end; ++pp) {
+                    const Vector<real, dim> node = particles[pp].x / sim.dx();
+                    if (!node.allFinite()) { continue; }
+                    if constexpr (dim == 3) {
+                        if (std::lround(node(settings.axis)) != layer) { continue; }
+                    }
+                    const long u = std::lround(node(u_axis)), v = std::lround(node(v_axis));
+                    if (u < 0 || u >= nodes || v < 0 || v >= nodes) { continue; }
+                    sums[chunk][u * nodes + v] += particles[pp].Jp;
+                    counts[chunk][u * nodes + v] += 1;
+                }
+            });
+            for (std::size_t ii = 0; ii < values.size(); ++ii) {
+                real sum = 0, count = 0;
+                for (int chunk = 0; chunk < chunks; ++chunk) {
+                    sum += sums[chunk][ii];
+                    count += counts[chunk][ii];
+                }
+                values[ii] = count > 0 ? sum / count : 0;
+                covered[ii] = count > 0;
+            }
+        } else if (!sim.grid().empty()) {
+            // Before the first step there is no grid and everything stays 0
+            parallel_for(nodes, threads, [&](int u) {
+                for (int v = 0; v < nodes; ++v) {
+                    const auto &cell = sim.grid()[node_index(u, v)];
+                    values[u * nodes + v] = settings.field == GridField::kMass ? cell.mass : cell.velocity.norm();
+                }
+            });
+        }
+
+        real lo = settings.field == GridField::kJp ? settings.min : 0, hi = settings.max;
+        if (hi <= 0) {
+            bool first = true;
+            for (std::size_t ii = 0; ii < values.size(); ++ii) {
+                if (!covered[ii] || !std::isfinite(values[ii])) { continue; }
+                if (settings.field == GridField::kJp) { lo = first ? values[ii] : std::min(lo, values[ii]); }
+                hi = first ? values[ii] : std::max(hi, values[ii]);
+                first = false;
+            }
+        }
+        const real range = hi > lo ? hi - lo : 1;
+
+        Image image;
+        image.width = image.height = nodes * settings.scale;
+        image.rgba.resize(std::size_t(image.width) * image.height * 4);
+        parallel_for(image.height, threads, [&](int py) {
+            const int v = nodes - 1 - py / settings.scale;
+            for (int px = 0; px < image.width; ++px) {
+                const std::size_t ii = std::size_t(px / settings.scale) * nodes + v;
+                image.set(px, py, covered[ii] ? colormap((values[ii] - lo) / range) : settings.background);
+            }
+        });
+        return image;
+    }
+}// namespace nclr
@@ -0,0 +1,677 @@
+#pragma once
+
+#include "nclr.h"
+#include "nclr_mesh.h"
+#include "nclr_render.h"
+#include "nclr_seed.h"
+#include "nclr_surface.h"
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace nclr {
+    namespace json {
+        /**
+         * Just enough JSON to describe a scene: a parsed document is a tree of Values, and every accessor throws
+         * std::runtime_error with the offending key when the document doesn't have the expected shape.
+         */
+        struct Value {
+            enum class Type {
+                kNull = 0,
+                kBool,
+                kNumber,
+                kString,
+                kArray,
+                kObject,
+            };
+
+            Type type = Type::kNull;
+            bool boolean = false;
+            double number = 0.0;
+            std::string string;
+            std::vector<Value> array;
+            std::map<std::string, Value> object;
+
+            auto contains(const std::string &key) const -> bool {
+                return type == Type::kObject && object.find(key) != object.end();
+            }
+
+            auto at(const std::string &key) const -> const Value & {
+                if (!contains(key)) { throw std::runtime_error("missing key \"" + key + "\""); }
+                return object.at(key);
+            }
+
+            auto as_number(const std::string &what = "value") const -> double {
+                if (type != Type::kNumber) { throw std::runtime_error(what + " must be a number"); }
+                return number;
+            }
+
+            auto as_bool(const std::string &what = "value") const -> bool {
+                if (type != Type::kBool) { throw std::runtime_error(what + " must be true or false"); }
+                return boolean;
+            }
+
+            auto as_string(const std::string &what = "value") const -> const std::string & {
+                if (type != Type::kString) { throw std::runtime_error(what + " must be a string"); }
+                return string;
+            }
+
+            auto as_array(const std::string &what = "value") const -> const std::vector<Value> & {
+                if (type != Type::kArray) { throw std::runtime_error(what + " must be an array"); }
+                return array;
+            }
+
+            // Typed lookups with a fallback for optional keys
+            auto get(const std::string &key, double fallback) const -> double {
+                return contains(key) ? at(key).as_number(key) : fallback;
+            }
+
+            auto get(const std::string &key, bool fallback) const -> bool {
+                return contains(key) ? at(key).as_bool(key) : fallback;
+            }
+
+            auto get(const std::string &key, const std::string &fallback) const -> std::string {
+                return contains(key) ? at(key).as_string(key) : fallback;
+            }
+        };
+
+        class Parser {
+        public:
+            explicit Parser(const std::string &text) : text_(text) {}
+
+            auto parse() -> Value {
+                Value value = parse_value();
+                skip_whitespace();
+                if (pos_ != text_.size()) { fail("trailing characters"); }
+                return value;
+            }
+
+        private:
+            const std::string &text_;
+            std::size_t pos_ = 0;
+
+            [[noreturn]] auto fail(const std::string &message) const -> void {
+                throw std::runtime_error("JSON parse error at offset " + std::to_string(pos_) + ": " + message);
+            }
+
+            auto skip_whitespace() -> void {
+                while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) { ++pos_; }
+            }
+
+            auto peek() -> char {
+                skip_whitespace();
+                if (pos_ >= text_.size()) { fail("unexpected end of input"); }
+                return text_[pos_];
+            }
+
+            auto expect(char c) -> void {
+                if (peek() != c) { fail(std::string("expected '") + c + "'"); }
+                ++pos_;
+            }
+
+            auto consume_literal(const std::string &literal) -> void {
+                if (text_.compare(pos_, literal.size(), literal) != 0) { fail("invalid literal"); }
+                pos_ += literal.size();
+            }
+
+            auto parse_value() -> Value {
+                Value value;
+                switch (peek()) {
+                    case '{':
+                        value.type = Value::Type::kObject;
+                        ++pos_;
+                        if (peek() == '}') {
+                            ++pos_;
+                            break;
+                        }
+                        do {
+                            const std::string key = parse_string();
+                            expect(':');
+                            value.object[key] = parse_value();
+                        } while (peek() == ',' && ++pos_);
+                        expect('}');
+                        break;
+                    case '[':
+                        value.type = Value::Type::kArray;
+                        ++pos_;
+                        if (peek() == ']') {
+                            ++pos_;
+                            break;
+                        }
+                        do { value.array.push_back(parse_value()); } while (peek() == ',' && ++pos_);
+                        expect(']');
+                        break;
+                    case '"':
+                        value.type = Value::Type::kString;
+                        value.string = parse_string();
+                        break;
+                    case 't':
+                        value.type = Value::Type::kBool;
+                        value.boolean = true;
+                        consume_literal("true");
+                        break;
+                    case 'f':
+                        value.type = Value::Type::kBool;
+                        consume_literal("false");
+                        break;
+                    case 'n':
+                        consume_literal("null");
+                        break;
+                    default: {
+                        value.type = Value::Type::kNumber;
+                        const char *begin = text_.c_str() + pos_;
+                        char *end = nullptr;
+                        value.number = std::strtod(begin, &end);
+                        if (end == begin) { fail("invalid value"); }
+                        pos_ += end - begin;
+                    }
+                }
+                return value;
+            }
+
+            auto parse_string() -> std::string {
+                expect('"');
+                std::string out;
+                while (pos_ < text_.size() && text_[pos_] != '"') {
+                    char c = text_[pos_++];
+                    if (c == '\\') {
+                        if (pos_ >= text_.size()) { break; }
+                        c = text_[pos_++];
+                        switch (c) {
+                            case 'n':
+                                c = '\n';
+                                break;
+                            case 't':
+                                c = '\t';
+                                break;
+                            case 'r':
+                                c = '\r';
+                                break;
+                            case 'b':
+                                c = '\b';
+                                break;
+                            case 'f':
+                                c = '\f';
+                                break;
+                            case 'u':
+                                fail("unicode escapes are not supported");
+                            default:
+                                break;
+                        }
+                    }
+                    out.push_back(c);
+                }
+                if (pos_ >= text_.size()) { fail("unterminated string"); }
+                ++pos_;
+                return out;
+            }
+        };
+
+        inline auto parse(const std::string &text) -> Value { return Parser(text).parse(); }
+
+        inline auto parse_file(const std::string &filename) -> Value {
+            std::ifstream ifs(filename);
+            if (!ifs.is_open()) { throw std::runtime_error("could not open " + filename); }
+            std::stringstream buffer;
+            buffer << ifs.rdbuf();
+            return parse(buffer.str());
+        }
+    }// namespace json
+
+    template<int dim>
+    struct Emitter {
+        Sdf<dim> shape;
+
+        // Set for "mesh" emitters (3D only), which fill this closed mesh instead of the shape
+        std::shared_ptr<const TriangleMesh> mesh;
+
+        // How the shape is filled, see seed()
+        SeedPattern pattern;
+        real dx;
+        int ppc;
+        uint32_t seed;
+
+        Vector<real, dim> velocity;
+
+        // Color
+        int c;
+    };
+
+    template<int dim>
+    struct Scene {
+        int res = 64;
+        real dt = 1e-4;
+        real extent = 1.0;
+        int steps = 1000;
+
+        MaterialModel model = MaterialModel::kJelly;
+        real E = 1000.0;
+        real nu = 0.3;
+        real gravity = -100.0;
+
+        std::vector<Emitter<dim>> emitters;
+        std::vector<Collider<dim>> colliders;
+        std::vector<Source<dim>> sources;
+        std::vector<Sink<dim>> sinks;
+
+        // What happens to particles that leave the domain
+        EscapePolicy escape = EscapePolicy::kClamp;
+
+        // Rest detection, off unless the scene has a "sleep" block
+        SleepSettings sleep;
+
+        // Adaptive particle resolution, off unless the scene has an "adaptive" block
+        AdaptiveSettings adaptive;
+
+        // Two-level grid, off unless the scene has a "refine" block
+        RefineSettings refine;
+
+        // Dump every `output_every` steps into `output_directory`, 0 disables output
+        int output_every = 0;
+        std::string output_directory = "tmp";
+
+        // Render a PPM frame every `render_every` steps into `render_directory`, 0 disables rendering
+        int render_every = 0;
+        std::string render_directory = "frames";
+        int render_width = 800;
+        int render_height = 800;
+        real render_radius = 1.5;
+        Camera camera;
+
+        // Write a colormapped image of each field every `fields_every` steps, 0 disables them
+        int fields_every = 0;
+        std::string fields_directory = "fields";
+        std::vector<FieldImageSettings> fields;
+
+        // Write a reconstructed surface mesh every `surface_every` steps (3D only), 0 disables meshing
+        int surface_every = 0;
+        std::string surface_directory = "surface";
+        std::string surface_format = "ply";
+        SurfaceSettings surface;
+
+        // Mesh and write on a separate output thread while the simulation keeps stepping
+        bool surface_async = false;
+
+        // Worker threads for scene setup and the solver, 0 picks one per core
+        int threads = 0;
+    };
+
+    inline auto parse_material_model(const std::string &material_model) -> MaterialModel {
+        if (material_model == "jelly") { return MaterialModel::kJelly; }
+        if (material_model == "snow") { return MaterialModel::kSnow; }
+        if (material_model == "liquid") { return MaterialModel::kLiquid; }
+        throw std::runtime_error("unknown material model \"" + material_model + "\"");
+    }
+
+    inline auto parse_escape_policy(const std::string &escape) -> EscapePolicy {
+        if (escape == "clamp") { return EscapePolicy::kClamp; }
+        if (escape == "delete") { return EscapePolicy::kDelete; }
+        if (escape == "count") { return EscapePolicy::kCount; }
+        throw std::runtime_error("unknown escape policy \"" + escape + "\"");
+    }
+
+    template<int dim>
+    inline auto to_vector(const json::Value &value, const std::string &what) -> Vector<real, dim> {
+        const auto &array = value.as_array(what);
+        if (array.size() != dim) {
+            throw std::runtime_error(what + " must have " + std::to_string(dim) + " components");
+        }
+        Vector<real, dim> out;
+        for (int dd = 0; dd < dim; ++dd) { out(dd) = array.at(dd).as_number(what); }
+        return out;
+    }
+
+    // A size is either one number for every axis or one per axis
+    template<int dim>
+    inline auto to_size(const json::Value &value, const std::string &what) -> Vector<real, dim> {
+        return value.type == json::Value::Type::kNumber ? constvec<dim>(value.number) : to_vector<dim>(value, what);
+    }
+
+    template<int dim>
+    inline auto load_shape(const json::Value &shape) -> Sdf<dim> {
+        const auto type = shape.get("type", std::string("cube"));
+        if (type == "cube" || type == "box") {
+            const Vector<real, dim> size = shape.contains("size") ? to_size<dim>(shape.at("size"), "size")
+                                                                   : constvec<dim>(0.2);
+            return box<dim>(to_vector<dim>(shape.at("center"), "center"), size / 2);
+        }
+        if (type == "sphere") {
+            return sphere<dim>(to_vector<dim>(shape.at("center"), "center"), shape.at("radius").as_number("radius"));
+        }
+        if (type == "cylinder") {
+            return cylinder<dim>(to_vector<dim>(shape.at("center"), "center"), shape.at("radius").as_number("radius"),
+                                 shape.at("height").as_number("height") / 2);
+        }
+        if (type == "union" || type == "difference" || type == "intersection") {
+            std::vector<Sdf<dim>> shapes;
+            for (const auto &child : shape.at("shapes").as_array("shapes")) {
+                shapes.push_back(load_shape<dim>(child));
+            }
+            if (shapes.empty()) { throw std::runtime_error(type + " needs at least one shape"); }
+            return type == "union" ? unite<dim>(shapes) : type == "difference" ? subtract<dim>(shapes)
+                                                                                : intersect<dim>(shapes);
+        }
+        throw std::runtime_error("unknown shape \"" + type + "\"");
+    }
+
+    inline auto parse_projection(const std::string &projection) -> Projection {
+        if (projection == "orthographic") { return Projection::kOrthographic; }
+        if (projection == "perspective") { return Projection::kPerspective; }
+        throw std::runtime_error("unknown projection \"" + projection + "\"");
+    }
+
+    inline auto parse_grid_field(const std::string &field) -> GridField {
+        if (field == "mass") { return GridField::kMass; }
+        if (field == "velocity") { return GridField::kVelocity; }
+        if (field == "jp") { return GridField::kJp; }
+        throw std::runtime_error("unknown grid field \"" + field + "\"");
+    }
+
+    inline auto parse_seed_pattern(const std::string &pattern) -> SeedPattern {
+        if (pattern == "lattice") { return SeedPattern::kLattice; }
+        if (pattern == "jittered") { return SeedPattern::kJittered; }
+        if (pattern == "poisson") { return SeedPattern::kPoisson; }
+        throw std::runtime_error("unknown sampling pattern \"" + pattern + "\"");
+    }
+
+    /**
+     * Builds a scene from a parsed document, for example
+     * {
+     *   "dim": 2, "res": 64, "dt": 1e-4, "steps": 4000, "escape": "clamp",
+     *   "material": {"model": "snow", "E": 1000, "nu": 0.3}, "gravity": -100,
+     *   "emitters": [{"shape": {"type": "cube", "center": [0.5, 0.7], "size": 0.2}, "resolution": 25},
+     *                {"shape": {"type": "difference",
+     *                           "shapes": [{"type": "sphere", "center": [0.3, 0.5], "radius": 0.1},
+     *                                      {"type": "box", "center": [0.3, 0.5], "size": 0.05}]},
+     *                 "sampling": {"pattern": "poisson", "ppc": 4, "seed": 1}}],
+     *   "colliders": [{"type": "sphere", "center": [0.5, 0.3], "radius": 0.1, "sticky": false}],
+     *   "sources": [{"center": [0.2, 0.8], "size": 0.02, "velocity": [2, 0], "per_step": 2}],
+     *   "sinks": [{"type": "plane", "point": [0.9, 0], "normal": [-1, 0]}],
+     *   "sleep": {"velocity": 0.05, "deformation": 1e-4, "steps": 100, "wake_velocity": 0.5},
+     *   "adaptive": {"every": 10, "split_strain": 1e-3, "merge_strain": 1e-4, "split_levels": 1, "merge_levels": 1,
+     *                "spacing": 0.5, "max_particles": 0},
+     *   "refine": {"every": 10, "strain": 1e-3},
+     *   "output": {"every": 10, "directory": "tmp"},
+     *   "render": {"every": 10, "directory": "frames", "width": 800, "height": 800, "radius": 1.5,
+     *              "camera": {"projection": "perspective", "yaw": 28, "pitch": 32, "distance": 2, "fov": 40}},
+     *   "fields": {"every": 10, "directory": "fields", "quantities": ["mass", "velocity", "jp"], "scale": 4,
+     *              "axis": "z", "slice": 0.5},
+     *   "surface": {"every": 10, "directory": "surface", "format": "ply", "ppc": 4, "async": true},
+     *   "parallel": {"threads": 8}
+     * }
+     * Every key is optional, but the scene needs an emitter or a source. A "cube" emitter without "sampling" is the
+     * regular lattice of cube() with "resolution" points per side, every other emitter defaults to 4 jittered
+     * particles per grid cell. In 3D, {"type": "mesh", "path": "bunny.obj", "scale": 1, "translate": [0, 0, 0]}
+     * fills a closed OBJ or PLY mesh. The "camera" of "render" orbits the domain's center and is ignored in 2D.
+     * "surface" is 3D only, its "spacing" and "radius" are in grid cells and default to SurfaceSettings::for_grid().
+     */
+    template<int dim>
+    inline auto load_scene(const json::Value &root) -> Scene<dim> {
+        Scene<dim> scene;
+        scene.res = root.get("res", double(scene.res));
+        scene.dt = root.get("dt", double(scene.dt));
+        scene.extent = root.get("extent", double(scene.extent));
+        scene.steps = root.get("steps", double(scene.steps));
+        scene.gravity = root.get("gravity", double(scene.gravity));
+        scene.escape = parse_escape_policy(root.get("escape", std::string("clamp")));
+
+        if (root.contains("material")) {
+            const auto &material = root.at("material");
+            scene.model = parse_material_model(material.get("model", std::string("jelly")));
+            scene.E = material.get("E", double(scene.E));
+            scene.nu = material.get("nu", double(scene.nu));
+        }
+
+        const real grid_dx = scene.extent / scene.res;
+        const std::vector<json::Value> no_emitters;
+        for (const auto &emitter :
+             root.contains("emitters") ? root.at("emitters").as_array("emitters") : no_emitters) {
+            const auto &shape = emitter.at("shape");
+            const bool is_mesh = shape.get("type", std::string("cube")) == "mesh";
+            Emitter<dim> out{is_mesh ? sphere<dim>(constvec<dim>(0), 0) : load_shape<dim>(shape),
+                             nullptr,
+                             SeedPattern::kJittered,
+                             grid_dx,
+                             4,
+                             0,
+                             emitter.contains("velocity") ? to_vector<dim>(emitter.at("velocity"), "velocity")
+                                                          : constvec<dim>(0),
+                             int(emitter.get("color", double(0xED553B)))};
+
+            if (is_mesh) {
+                if (dim != 3) { throw std::runtime_error("mesh emitters need a 3D scene"); }
+                auto mesh = std::make_shared<TriangleMesh>(load_mesh(shape.at("path").as_string("path")));
+                mesh->transform(shape.get("scale", 1.0), shape.contains("translate")
+                                                                 ? to_vector<3>(shape.at("translate"), "translate")
+                                                                 : constvec<3>(0));
+                out.mesh = mesh;
+            }
+
+            if (emitter.contains("sampling")) {
+                const auto &sampling = emitter.at("sampling");
+                out.pattern = parse_seed_pattern(sampling.get("pattern", std::string("jittered")));
+                out.ppc = sampling.get("ppc", double(out.ppc));
+                out.seed = sampling.get("seed", 0.0);
+            } else if (shape.get("type", std::string("cube")) == "cube") {
+                const int resolution = emitter.get("resolution", 25.0);
+                out.pattern = SeedPattern::kLattice;
+                out.dx = resolution > 1 ? 2 * out.shape.half_extent.maxCoeff() / (resolution - 1) : grid_dx;
+                out.ppc = 1;
+            }
+            scene.emitters.push_back(out);
+        }
+
+        if (root.contains("colliders")) {
+            for (const auto &collider : root.at("colliders").as_array("colliders")) {
+                const auto type = collider.at("type").as_string("type");
+                const bool sticky = collider.get("sticky", true);
+                if (type == "plane") {
+                    scene.colliders.emplace_back(ColliderShape::kPlane, to_vector<dim>(collider.at("point"), "point"),
+                                                 to_vector<dim>(collider.at("normal"), "normal"), 0.0, sticky);
+                } else if (type == "sphere") {
+                    scene.colliders.emplace_back(ColliderShape::kSphere,
+                                                 to_vector<dim>(collider.at("center"), "center"), constvec<dim>(0),
+                                                 collider.at("radius").as_number("radius"), sticky);
+                } else {
+                    throw std::runtime_error("unknown collider type \"" + type + "\"");
+                }
+            }
+        }
+
+        if (root.contains("sources")) {
+            for (const auto &source : root.at("sources").as_array("sources")) {
+                scene.sources.push_back(
+                        {to_vector<dim>(source.at("center"), "center"),
+                         (source.contains("size") ? to_size<dim>(source.at("size"), "size") : constvec<dim>(0.02)) / 2,
+                         source.contains("velocity") ? to_vector<dim>(source.at("velocity"), "velocity")
+                                                     : constvec<dim>(0),
+                         int(source.get("per_step", 1.0)), int(source.get("color", double(0xED553B)))});
+            }
+        }
+
+        if (root.contains("sinks")) {
+            for (const auto &sink : root.at("sinks").as_array("sinks")) {
+                const auto type = sink.at("type").as_string("type");
+                if (type == "plane") {
+                    scene.sinks.emplace_back(ColliderShape::kPlane, to_vector<dim>(sink.at("point"), "point"),
+                                             to_vector<dim>(sink.at("normal"), "normal"));
+                } else if (type == "sphere") {
+                    scene.sinks.emplace_back(ColliderShape::kSphere, to_vector<dim>(sink.at("center"), "center"),
+                                             constvec<dim>(0), sink.at("radius").as_number("radius"));
+                } else {
+                    throw std::runtime_error("unknown sink type \"" + type + "\"");
+                }
+            }
+        }
+
+        if (scene.emitters.empty() && scene.sources.empty()) {
+            throw std::runtime_error("the scene needs at least one emitter or source");
+        }
+
+        if (root.contains("sleep")) {
+            const auto &sleep = root.at("sleep");
+            scene.sleep.enabled = sleep.get("enabled", true);
+            scene.sleep.velocity = sleep.get("velocity", double(scene.sleep.velocity));
+            scene.sleep.deformation = sleep.get("deformation", double(scene.sleep.deformation));
+            scene.sleep.steps = sleep.get("steps", double(scene.sleep.steps));
+            scene.sleep.wake_velocity = sleep.get("wake_velocity", double(scene.sleep.wake_velocity));
+            if (scene.sleep.steps <= 0 || scene.sleep.wake_velocity < scene.sleep.velocity) {
+                throw std::runtime_error("sleep steps must be positive and wake_velocity at least velocity");
+            }
+        }
+
+        if (root.contains("adaptive")) {
+            const auto &adaptive = root.at("adaptive");
+            scene.adaptive.enabled = adaptive.get("enabled", true);
+            scene.adaptive.every = adaptive.get("every", double(scene.adaptive.every));
+            scene.adaptive.split_strain = adaptive.get("split_strain", double(scene.adaptive.split_strain));
+            scene.adaptive.merge_strain = adaptive.get("merge_strain", double(scene.adaptive.merge_strain));
+            scene.adaptive.split_levels = adaptive.get("split_levels", double(scene.adaptive.split_levels));
+            scene.adaptive.merge_levels = adaptive.get("merge_levels", double(scene.adaptive.merge_levels));
+            scene.adaptive.spacing = adaptive.get("spacing", double(scene.adaptive.spacing));
+            scene.adaptive.max_particles = adaptive.get("max_particles", 0.0);
+            if (scene.adaptive.every <= 0 || scene.adaptive.split_levels < 0 || scene.adaptive.merge_levels < 0 ||
+                scene.adaptive.merge_strain > scene.adaptive.split_strain || scene.adaptive.spacing <= 0) {
+                throw std::runtime_error("adaptive every and spacing must be positive, levels non-negative and "
+                                         "merge_strain at most split_strain");
+            }
+        }
+
+        if (root.contains("refine")) {
+            const auto &refine = root.at("refine");
+            scene.refine.enabled = refine.get("enabled", true);
+            scene.refine.every = refine.get("every", double(scene.refine.every));
+            scene.refine.strain = refine.get("strain", double(scene.refine.strain));
+            if (scene.refine.every <= 0) { throw std::runtime_error("refine every must be positive"); }
+        }
+
+        if (root.contains("output")) {
+            const auto &output = root.at("output");
+            scene.output_every = output.get("every", 1.0);
+            scene.output_directory = output.get("directory", scene.output_directory);
+        }
+
+        if (root.contains("render")) {
+            const auto &render = root.at("render");
+            scene.render_every = render.get("every", 1.0);
+            scene.render_directory = render.get("directory", scene.render_directory);
+            scene.render_width = render.get("width", double(scene.render_width));
+            scene.render_height = render.get("height", double(scene.render_height));
+            scene.render_radius = render.get("radius", double(scene.render_radius));
+            if (scene.render_width <= 0 || scene.render_height <= 0) {
+                throw std::runtime_error("render width and height must be positive");
+            }
+
+            const json::Value no_camera;
+            const auto &camera = render.contains("camera") ? render.at("camera") : no_camera;
+            scene.camera = Camera::orbit(constvec<3>(scene.extent / 2), camera.get("distance", 2.0) * scene.extent,
+                                         camera.get("yaw", 28.0), camera.get("pitch", 32.0),
+                                         parse_projection(camera.get("projection", std::string("orthographic"))));
+            scene.camera.half_height *= scene.extent;
+            scene.camera.fov = camera.get("fov", double(scene.camera.fov));
+        }
+
+        if (root.contains("fields")) {
+            const auto &fields = root.at("fields");
+            scene.fields_every = fields.get("every", 1.0);
+            scene.fields_directory = fields.get("directory", scene.fields_directory);
+
+            FieldImageSettings settings;
+            settings.scale = fields.get("scale", double(settings.scale));
+            settings.slice = fields.get("slice", double(settings.slice));
+            const auto axis = fields.get("axis", std::string("z"));
+            if (axis != "x" && axis != "y" && axis != "z") {
+                throw std::runtime_error("unknown axis \"" + axis + "\"");
+            }
+            settings.axis = axis[0] - 'x';
+            if (settings.scale <= 0) { throw std::runtime_error("fields scale must be positive"); }
+
+            std::vector<std::string> quantities{"mass"};
+            if (fields.contains("quantities")) {
+                quantities.clear();
+                for (const auto &quantity : fields.at("quantities").as_array("quantities")) {
+                    quantities.push_back(quantity.as_string("quantities"));
+                }
+            }
+            for (const auto &quantity : quantities) {
+                settings.field = parse_grid_field(quantity);
+                scene.fields.push_back(settings);
+            }
+        }
+
+        if (root.contains("surface")) {
+            if (dim != 3) { throw std::runtime_error("surface reconstruction needs a 3D scene"); }
+            const auto &surface = root.at("surface");
+            scene.surface_every = surface.get("every", 1.0);
+            scene.surface_directory = surface.get("directory", scene.surface_directory);
+            scene.surface_format = surface.get("format", scene.surface_format);
+            if (scene.surface_format != "ply" && scene.surface_format != "obj") {
+                throw std::runtime_error("unknown surface format \"" + scene.surface_format + "\"");
+            }
+            scene.surface_async = surface.get("async", false);
+
+            scene.surface = SurfaceSettings::for_grid(grid_dx, surface.get("ppc", 4.0));
+            scene.surface.spacing = surface.get("spacing", double(scene.surface.spacing / grid_dx)) * grid_dx;
+            scene.surface.radius = surface.get("radius", double(scene.surface.radius / grid_dx)) * grid_dx;
+            scene.surface.iso = surface.get("iso", double(scene.surface.iso));
+            if (scene.surface.spacing <= 0 || scene.surface.radius <= 0) {
+                throw std::runtime_error("surface spacing and radius must be positive");
+            }
+        }
+
+        if (root.contains("parallel")) {
+            const auto &parallel = root.at("parallel");
+            scene.threads = parallel.get("threads", 0.0);
+        }
+
+        if (scene.res <= 2 * MPMSimulation<dim>::kBoundary || scene.dt <= 0 || scene.extent <= 0) {
+            throw std::runtime_error("res must exceed the boundary layer, dt and extent must be positive");
+        }
+
+        return scene;
+    }
+
+    /**
+     * Seeds every emitter (each one in parallel, see seed()) and converts the positions into particles in parallel
+     * blocks of a pre-sized output.
+     */
+    template<int dim>
+    inline auto build_particles(const Scene<dim> &scene) -> std::vector<Particle<dim>> {
+        constexpr int kBlockSize = 4096;
+
+        std::vector<std::vector<Vector<real, dim>>> positions;
+        std::vector<std::size_t> offsets{0};
+        for (const auto &emitter : scene.emitters) {
+            if constexpr (dim == 3) {
+                if (emitter.mesh) {
+                    positions.push_back(seed_mesh(*emitter.mesh, emitter.pattern, emitter.dx, emitter.ppc,
+                                                  emitter.seed, scene.threads));
+                    offsets.push_back(offsets.back() + positions.back().size());
+                    continue;
+                }
+            }
+            positions.push_back(seed<dim>(emitter.shape, emitter.pattern, emitter.dx, emitter.ppc, emitter.seed,
+                                          scene.threads));
+            offsets.push_back(offsets.back() + positions.back().size());
+        }
+
+        std::vector<Particle<dim>> particles(offsets.back(), Particle<dim>(constvec<dim>(0), 0));
+        for (int ee = 0; ee < scene.emitters.size(); ++ee) {
+            const auto &emitter = scene.emitters.at(ee);
+            const auto &emitted = positions.at(ee);
+            parallel_blocks(emitted.size(), kBlockSize, scene.threads, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t ii = begin; ii < end; ++ii) {
+                    particles[offsets.at(ee) + ii] = Particle<dim>(emitted[ii], emitter.c, emitter.velocity);
+                }
+            });
+        }
+
+        return particles;
+    }
+}// namespace nclr
@@ -0,0 +1,412 @@
+#pragma once
+
+#include "nclr_math.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace nclr {
+    enum class SdfType {
+        kSphere = 0,
+        kBox,
+        kCylinder,
+        kUnion,
+        kDifference,
+        kIntersection,
+    };
+
+    /**
+     * A signed distance shape, negative inside. Composite shapes hold their operands by value, so a whole shape
+     * tree is a plain value that any number of threads can evaluate at once.
+     */
+    template<int dim>
+    struct Sdf {
+        SdfType type;
+
+        // Center of the primitive
+        Vector<real, dim> center;
+
+        // Half extents of a box
+        Vector<real, dim> half_extent;
+
+        // Radius of a sphere or cylinder, and half height of a cylinder (its axis is y)
+        real radius;
+        real half_height;
+
+        // Operands of union, difference (children[0] minus the rest) and intersection
+        std::vector<Sdf<dim>> children;
+
+        auto distance(const Vector<real, dim> &x) const -> real {
+            switch (type) {
+                case SdfType::kSphere:
+                    return (x - center).norm() - radius;
+                case SdfType::kBox: {
+                    const Vector<real, dim> q = (x - center).cwiseAbs() - half_extent;
+                    return q.cwiseMax(0).norm() + std::min(q.maxCoeff(), real(0));
+                }
+                case SdfType::kCylinder: {
+                    Vector<real, dim> radial = x - center;
+                    radial(1) = 0;
+                    const real dr = radial.norm() - radius;
+                    const real dh = std::abs(x(1) - center(1)) - half_height;
+                    return std::sqrt(std::max(dr, real(0)) * std::max(dr, real(0)) +
+                                     std::max(dh, real(0)) * std::max(dh, real(0))) +
+                           std::min(std::max(dr, dh), real(0));
+                }
+                case SdfType::kUnion: {
+                    real d = children.front().distance(x);
+                    for (std::size_t ii = 1; ii < children.size(); ++ii) { d = std::min(d, children.at(ii).distance(x)); }
+                    return d;
+                }
+                case SdfType::kDifference: {
+                    real d = children.front().distance(x);
+                    for (std::size_t ii = 1; ii < children.size(); ++ii) { d = std::max(d, -children.at(ii).distance(x)); }
+                    return d;
+                }
+                case SdfType::kIntersection: {
+                    real d = children.front().distance(x);
+                    for (std::size_t ii = 1; ii < children.size(); ++ii) { d = std::max(d, children.at(ii).distance(x)); }
+                    return d;
+                }
+                default:
+                    return 1;
+            }
+        }
+
+        // Axis-aligned box containing the shape
+        auto bounds(Vector<real, dim> &lo, Vector<real, dim> &hi) const -> void {
+            switch (type) {
+                case SdfType::kSphere:
+                    lo = center - constvec<dim>(radius);
+                    hi = center + constvec<dim>(radius);
+                    break;
+                case SdfType::kBox:
+                    lo = center - half_extent;
+                    hi = center + half_extent;
+                    break;
+                case SdfType::kCylinder:
+                    lo = center - constvec<dim>(radius);
+                    hi = center + constvec<dim>(radius);
+                    lo(1) = center(1) - half_height;
+                    hi(1) = center(1) + half_height;
+                    break;
+                case SdfType::kDifference:
+                    children.front().bounds(lo, hi);
+                    break;
+                default: {
+                    children.front().bounds(lo, hi);
+                    for (std::size_t ii = 1; ii < children.size(); ++ii) {
+                        Vector<real, dim> child_lo, child_hi;
+                        children.at(ii).bounds(child_lo, child_hi);
+                        if (type == SdfType::kUnion) {
+                            lo = lo.cwiseMin(child_lo);
+                            hi = hi.cwiseMax(child_hi);
+                        } else {
+                            lo = lo.cwiseMax(child_lo);
+                            hi = hi.cwiseMin(child_hi);
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    template<int dim>
+    inline auto sphere(const Vector<real, dim> &center, real radius) -> Sdf<dim> {
+        return Sdf<dim>{SdfType::kSphere, center, constvec<dim>(0), radius, 0, {}};
+    }
+
+    template<int dim>
+    inline auto box(const Vector<real, dim> &center, const Vector<real, dim> &half_extent) -> Sdf<dim> {
+        return Sdf<dim>{SdfType::kBox, center, half_extent, 0, 0, {}};
+    }
+
+    template<int dim>
+    inline auto cylinder(const Vector<real, dim> &center, real radius, real half_height) -> Sdf<dim> {
+        return Sdf<dim>{SdfType::kCylinder, center, constvec<dim>(0), radius, half_height, {}};
+    }
+
+    template<int dim>
+    inline auto unite(std::vector<Sdf<dim>> shapes) -> Sdf<dim> {
+        return Sdf<dim>{SdfType::kUnion, constvec<dim>(0), constvec<dim>(0), 0, 0, std::move(shapes)};
+    }
+
+    template<int dim>
+    inline auto subtract(std::vector<Sdf<dim>> shapes) -> Sdf<dim> {
+        return Sdf<dim>{SdfType::kDifference, constvec<dim>(0), constvec<dim>(0), 0, 0, std::move(shapes)};
+    }
+
+    template<int dim>
+    inline auto intersect(std::vector<Sdf<dim>> shapes) -> Sdf<dim> {
+        return Sdf<dim>{SdfType::kIntersection, constvec<dim>(0), constvec<dim>(0), 0, 0, std::move(shapes)};
+    }
+
+    /**
+     * Stateless random number in [0, 1) for a (seed, cell, sample) triple. Unlike nc_rand() it needs no shared
+     * state, so parallel seeding gives the same particles for any thread count.
+     */
+    inline auto nc_hash_rand(uint32_t seed, uint64_t cell, uint32_t sample) -> real {
+        // splitmix64 finalizer
+        uint64_t z = cell * 0x9E3779B97F4A7C15ull + (uint64_t(seed) << 32 | sample) + 0x632BE59BD9B4E019ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z ^= z >> 31;
+        return (z >> 40) * (1.0f / 16777216.0f);
+    }
+
+    enum class SeedPattern {
+        // Regular points, dx apart, starting at the corner of the shape's bounds
+        kLattice = 0,
+        // Exactly ppc samples per grid cell, stratified: one per sub-cell when ppc is a perfect power of dim,
+        // otherwise a Latin hypercube (one sample per 1 / ppc slab of the cell along every axis)
+        kJittered,
+        // Blue noise with roughly ppc samples per grid cell and no two samples closer than the disk radius
+        kPoisson,
+    };
+
+    namespace detail {
+        // Cells of size `spacing` covering the bounds of the shape
+        template<int dim>
+        struct SeedGrid {
+            Vector<real, dim> lo;
+            Vector<int, dim> n;
+            real spacing;
+
+            template<typename Shape>
+            SeedGrid(const Shape &shape, real spacing, int extra = 0) : spacing(spacing) {
+                Vector<real, dim> hi;
+                shape.bounds(lo, hi);
+                for (int dd = 0; dd < dim; ++dd) {
+                    n(dd) = std::max(int(std::ceil((hi(dd) - lo(dd)) / spacing - 1e-4)), 0) + extra;
+                }
+            }
+
+            auto size() const -> std::size_t {
+                std::size_t size = 1;
+                for (int dd = 0; dd < dim; ++dd) { size *= n(dd); }
+                return size;
+            }
+
+            auto cells_per_slab() const -> std::size_t { return size() / std::max(n(0), 1); }
+
+            // Last axis fastest
+            auto coord(std::size_t index) const -> Vector<int, dim> {
+                Vector<int, dim> cell;
+                for (int dd = dim - 1; dd >= 0; --dd) {
+                    cell(dd) = index % n(dd);
+                    index /= n(dd);
+                }
+                return cell;
+            }
+
+            auto index(const Vector<int, dim> &cell) const -> std::size_t {
+                std::size_t index = 0;
+                for (int dd = 0; dd < dim; ++dd) { index = index * n(dd) + cell(dd); }
+                return index;
+            }
+        };
+
+        /**
+         * Runs emit(cell, out) for every cell twice: once counting per x slab, then again writing into each slab's
+         * slice of a pre-sized output. emit must be deterministic for a given cell.
+         */
+        template<int dim, typename Emit>
+        inline auto two_pass(const SeedGrid<dim> &grid, int threads, Emit &&emit) -> std::vector<Vector<real, dim>> {
+            const int slabs = grid.size() > 0 ? grid.n(0) : 0;
+            std::vector<std::size_t> offsets(slabs + 1, 0);
+
+            parallel_for(slabs, threads, [&](int slab) {
+                std::size_t count = 0;
+                const auto counter = [&count](const Vector<real, dim> &) { ++count; };
+                for (std::size_t cc = 0; cc < grid.cells_per_slab(); ++cc) {
+                    emit(grid.coord(slab * grid.cells_per_slab() + cc), counter);
+                }
+                offsets.at(slab + 1) = count;
+            });
+            for (int slab = 0; slab < slabs; ++slab) { offsets.at(slab + 1) += offsets.at(slab); }
+
+            std::vector<Vector<real, dim>> positions(offsets.back());
+            parallel_for(slabs, threads, [&](int slab) {
+                std::size_t next = offsets.at(slab);
+                const auto writer = [&](const Vector<real, dim> &x) { positions[next++] = x; };
+                for (std::size_t cc = 0; cc < grid.cells_per_slab(); ++cc) {
+                    emit(grid.coord(slab * grid.cells_per_slab() + cc), writer);
+                }
+            });
+            return positions;
+        }
+
+        // Random order of [0, n) for a cell, Fisher-Yates driven by nc_hash_rand() samples from `first_sample` on
+        inline auto permutation(int n, uint32_t seed, uint64_t cell, uint32_t first_sample) -> std::vector<int> {
+            std::vector<int> order(n);
+            for (int ii = 0; ii < n; ++ii) { order[ii] = ii; }
+            for (int ii = n - 1; ii > 0; --ii) {
+                const int other = std::min(int(nc_hash_rand(seed, cell, first_sample + ii) * (ii + 1)), ii);
+                std::swap(order[ii], order[other]);
+            }
+            return order;
+        }
+    }// namespace detail
+
+    /**
+     * Fills the inside of a shape with particle positions at ppc particles per grid cell of size dx, in parallel on
+     * `threads` threads (0 picks one per core). Jittered seeding places exactly ppc samples in every cell, lattice
+     * seeding puts round(ppc^(1/dim)) points per cell along each axis and Poisson seeding lands close to ppc.
+     * Cells cut by the surface keep only their samples inside. The output is sized up front and is the same for
+     * any thread count.
+     *
+     * Any Shape with the distance() and bounds() members of Sdf works, only the sign of the distance is used.
+     */
+    template<int dim, typename Shape = Sdf<dim>>
+    inline auto seed(const Shape &shape, SeedPattern pattern, real dx, int ppc = 1, uint32_t seed_value = 0,
+                     int threads = 0) -> std::vector<Vector<real, dim>> {
+        const int per_axis = std::max(int(std::round(std::pow(real(ppc), real(1) / dim))), 1);
+
+        if (pattern == SeedPattern::kLattice) {
+            // One lattice point per cell corner, including the far side of the bounds
+            const real spacing = dx / per_axis;
+            const detail::SeedGrid<dim> grid(shape, spacing, 1);
+            const real tolerance = 1e-3 * spacing;
+            return detail::two_pass(grid, threads, [&](const Vector<int, dim> &cell, auto &&out) {
+                const Vector<real, dim> x = grid.lo + cell.template cast<real>() * spacing;
+                if (shape.distance(x) <= tolerance) { out(x); }
+            });
+        }
+
+        if (pattern == SeedPattern::kJittered) {
+            const int samples = std::max(ppc, 1);
+            int power = 1;
+            for (int dd = 0; dd < dim; ++dd) { power *= per_axis; }
+            const bool sub_cells = power == samples;
+
+            const detail::SeedGrid<dim> grid(shape, dx);
+            return detail::two_pass(grid, threads, [&](const Vector<int, dim> &cell, auto &&out) {
+                const uint64_t index = grid.index(cell);
+
+                // Latin hypercube: sample ss sits in slab ss along x and in slab strata[dd][ss] along the others
+                std::vector<std::vector<int>> strata(sub_cells ? 0 : dim);
+                for (int dd = 1; dd < int(strata.size()); ++dd) {
+                    strata[dd] = detail::permutation(samples, seed_value, index, (dim + dd) * samples);
+                }
+
+                for (int ss = 0; ss < samples; ++ss) {
+                    Vector<real, dim> x;
+                    for (int dd = dim - 1, rest = ss; dd >= 0; --dd, rest /= per_axis) {
+                        const real jitter = nc_hash_rand(seed_value, index, ss * dim + dd);
+                        const real offset = sub_cells ? (rest % per_axis + jitter) / per_axis
+                                                      : ((dd == 0 ? ss : strata[dd][ss]) + jitter) / samples;
+                        x(dd) = grid.lo(dd) + (cell(dd) + offset) * dx;
+                    }
+                    if (shape.distance(x) <= 0) { out(x); }
+                }
+            });
+        }
+
+        // Poisson disk sampling by dart throwing on a background grid with cells as wide as the disk radius, so a
+        // sample only has to be checked against its 3^dim neighborhood. Cells whose coordinates agree mod 3 never
+        // share a neighborhood and are filled in parallel, one phase at a time.
+        constexpr int kAttempts = 12;
+        // Disk radius relative to dx / ppc^(1/dim) that lands close to ppc samples per cell
+        constexpr real kPackingFactor = dim == 2 ? 0.8 : 0.84;
+        const real radius = kPackingFactor * dx / std::pow(real(ppc), real(1) / dim);
+        const real radius_2 = radius * radius;
+        const detail::SeedGrid<dim> grid(shape, radius);
+        std::vector<std::vector<Vector<real, dim>>> samples(grid.size());
+
+        int phases = 1;
+        for (int dd = 0; dd < dim; ++dd) { phases *= 3; }
+        for (int phase = 0; phase < phases; ++phase) {
+            Vector<int, dim> residue;
+            for (int dd = dim - 1, rest = phase; dd >= 0; --dd, rest /= 3) { residue(dd) = rest % 3; }
+
+            // Cells of this phase are residue + 3 * (a coarser grid)
+            Vector<int, dim> strided;
+            int jobs = 1;
+            for (int dd = 0; dd < dim; ++dd) {
+                strided(dd) = std::max((grid.n(dd) - residue(dd) + 2) / 3, 0);
+                jobs *= strided(dd);
+            }
+
+            parallel_for(jobs, threads, [&](int job) {
+                Vector<int, dim> cell;
+                for (int dd = dim - 1, rest = job; dd >= 0; --dd) {
+                    cell(dd) = residue(dd) + 3 * (rest % strided(dd));
+                    rest /= strided(dd);
+                }
+                const std::size_t index = grid.index(cell);
+                for (int attempt = 0; attempt < kAttempts; ++attempt) {
+                    Vector<real, dim> x;
+                    for (int dd = 0; dd < dim; ++dd) {
+                        x(dd) = grid.lo(dd) +
+                                (cell(dd) + nc_hash_rand(seed_value, index, attempt * dim + dd)) * grid.spacing;
+                    }
+                    if (shape.distance(x) > 0) { continue; }
+
+                    bool accepted = true;
+                    for (int nn = 0; nn < phases && accepted; ++nn) {
+                        Vector<int, dim> neighbor;
+                        for (int dd = dim - 1, rest = nn; dd >= 0; --dd, rest /= 3) {
+                            neighbor(dd) = cell(dd) + rest % 3 - 1;
+                        }
+                        if ((neighbor.array() < 0).any() || (neighbor.array() >= grid.n.array()).any()) { continue; }
+                        for (const auto &other : samples.at(grid.index(neighbor))) {
+                            if ((other - x).squaredNorm() < radius_2) {
+                                accepted = false;
+                                break;
+                            }
+                        }
+                    }
+                    if (accepted) { samples.at(index).push_back(x); }
+                }
+            });
+        }
+
+        std::vector<std::size_t> offsets(grid.size() + 1, 0);
+        for (std::size_t cc = 0; cc < grid.size(); ++cc) {
+            offsets.at(cc + 1) = offsets.at(cc) + samples.at(cc).size();
+        }
+        std::vector<Vector<real, dim>> positions(offsets.back());
+        parallel_blocks(grid.size(), 1024, threads, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t cc = begin; cc < end; ++cc) {
+                std::copy(samples.at(cc).begin(), samples.at(cc).end(), positions.begin() + offsets.at(cc));
+            }
+        });
+        return positions;
+    }
+
+    // Interleaves the low 21 bits of each coordinate, x in the lowest bit
+    template<int dim>
+    inline auto morton_code(const Vector<int, dim> &cell) -> uint64_t {
+        uint64_t code = 0;
+        for (int bit = 0; bit < 21; ++bit) {
+            for (int dd = 0; dd < dim; ++dd) { code |= uint64_t((cell(dd) >> bit) & 1) << (bit * dim + dd); }
+        }
+        return code;
+    }
+
+    /**
+     * Reorders positions along the Morton curve of the grid cells (of size dx) they fall in, so particles that
+     * share grid nodes also sit close together in memory. Particles in the same cell keep their relative order.
+     */
+    template<int dim>
+    inline auto morton_order(std::vector<Vector<real, dim>> &positions, real dx, int threads = 0) -> void {
+        constexpr std::size_t kBlockSize = 4096;
+
+        std::vector<std::pair<uint64_t, std::size_t>> keys(positions.size());
+        parallel_blocks(positions.size(), kBlockSize, threads, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t ii = begin; ii < end; ++ii) {
+                const Vector<int, dim> cell = (positions[ii] / dx).array().floor().template cast<int>().max(0);
+                keys[ii] = std::make_pair(morton_code<dim>(cell), ii);
+            }
+        });
+        std::sort(keys.begin(), keys.end());
+
+        std::vector<Vector<real, dim>> sorted(positions.size());
+        parallel_blocks(positions.size(), kBlockSize, threads, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t ii = begin; ii < end; ++ii) { sorted[ii] = positions[keys[ii].second]; }
+        });
+        positions = std::move(sorted);
+    }
+}// namespace nclr
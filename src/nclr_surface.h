@@ -0,0 +1,344 @@
+#pragma once
+
+#include "nclr_mesh.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace nclr {
+    struct SurfaceSettings {
+        // Edge length of the marching cubes voxels
+        real spacing = 0.5 / 64;
+
+        // Support radius of every particle's kernel
+        real radius = 1.5 / 64;
+
+        // Volume each particle stands for, the density is 1 inside a uniformly filled region
+        real particle_volume = 0.25 / (64 * 64 * 64);
+
+        // Density level of the surface, 0.5 puts it halfway across the kernel at a flat boundary
+        real iso = 0.5;
+
+        // Settings scaled to a simulation grid spacing for `ppc` particles per grid cell
+        static auto for_grid(real dx, real ppc = 4) -> SurfaceSettings {
+            return {dx / 2, dx * real(1.5), dx * dx * dx / ppc, 0.5};
+        }
+    };
+
+    namespace detail {
+        /**
+         * Triangles for each of the 256 inside/outside corner configurations of a cube, derived at startup instead
+         * of hand-written. On each face the contour runs from an edge where the face boundary enters the inside to
+         * the next edge where it leaves, so ambiguous faces always separate their inside corners. Both cubes sharing
+         * a face make the same choice, which keeps the surface watertight. The segments chain into closed loops
+         * that are split into triangle fans.
+         *
+         * Corners are numbered x + 2y + 4z, edge a * 4 + u + 2v runs along axis a at offsets (u, v) along the
+         * axes (a + 1) % 3 and (a + 2) % 3.
+         */
+        struct MarchingCubesTable {
+            // Edge triples per configuration, terminated by -1
+            std::array<std::array<int8_t, 16>, 256> triangles;
+
+            // Corner pair of each edge
+            std::array<std::array<int, 2>, 12> edges;
+
+            static auto corner(int axis, int along, int u, int v) -> int {
+                int bits[3];
+                bits[axis] = along;
+                bits[(axis + 1) % 3] = u;
+                bits[(axis + 2) % 3] = v;
+                return bits[0] + 2 * bits[1] + 4 * bits[2];
+            }
+
+            static auto edge(int c0, int c1) -> int {
+                const int axis = (c0 ^ c1) == 1 ? 0 : (c0 ^ c1) == 2 ? 1 : 2;
+                return axis * 4 + ((c0 >> ((axis + 1) % 3)) & 1) + 2 * ((c0 >> ((axis + 2) % 3)) & 1);
+            }
+
+            MarchingCubesTable() {
+                for (int axis = 0; axis < 3; ++axis) {
+                    for (int uv = 0; uv < 4; ++uv) {
+                        edges[axis * 4 + uv] = {corner(axis, 0, uv & 1, uv >> 1), corner(axis, 1, uv & 1, uv >> 1)};
+                    }
+                }
+
+                constexpr int kFace[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+                for (int config = 0; config < 256; ++config) {
+                    const auto inside = [&](int c) { return (config >> c) & 1; };
+
+                    // next[e] is the edge the contour moves to after crossing edge e
+                    std::array<int, 12> next;
+                    next.fill(-1);
+                    for (int axis = 0; axis < 3; ++axis) {
+                        for (int side = 0; side < 2; ++side) {
+                            // Counterclockwise seen from outside the cube
+                            int p[4];
+                            for (int kk = 0; kk < 4; ++kk) {
+                                const int ii = side == 1 ? kk : 3 - kk;
+                                p[kk] = corner(axis, side, kFace[ii][0], kFace[ii][1]);
+                            }
+                            for (int kk = 0; kk < 4; ++kk) {
+                                if (inside(p[kk]) || !inside(p[(kk + 1) % 4])) { continue; }
+                                for (int jj = kk + 1; jj < kk + 4; ++jj) {
+                                    if (inside(p[jj % 4]) && !inside(p[(jj + 1) % 4])) {
+                                        next[edge(p[kk], p[(kk + 1) % 4])] = edge(p[jj % 4], p[(jj + 1) % 4]);
+                                        break;
+                                    }
+                                }
+                            }
+                        }
+                    }
+
+                    int count = 0;
+                    std::array<bool, 12> visited{};
+                    for (int start = 0; start < 12; ++start) {
+                        if (next[start] < 0 || visited[start]) { continue; }
+                        std::vector<int> loop;
+                        for (int ee = start; !visited[ee]; ee = next[ee]) {
+                            visited[ee] = true;
+                            loop.push_back(ee);
+                        }
+                        for (std::size_t ii = 1; ii + 1 < loop.size(); ++ii) {
+                            triangles[config][count++] = loop[0];
+                            triangles[config][count++] = loop[ii];
+                            triangles[config][count++] = loop[ii + 1];
+                        }
+                    }
+                    std::fill(triangles[config].begin() + count, triangles[config].end(), -1);
+                }
+
+                // The loops are consistently oriented, flip them all if a lone inside corner's normal points at it
+                const auto midpoint = [&](int ee) -> Vector<real, 3> {
+                    Vector<real, 3> sum = constvec<3>(0);
+                    for (int c : edges[ee]) { sum += Vector<real, 3>(c & 1, (c >> 1) & 1, (c >> 2) & 1) / 2; }
+                    return sum;
+                };
+                const auto &t = triangles[1];
+                const Vector<real, 3> normal =
+                        (midpoint(t[1]) - midpoint(t[0])).cross(midpoint(t[2]) - midpoint(t[0]));
+                if (normal.sum() < 0) {
+                    for (auto &config : triangles) {
+                        for (int ii = 0; ii + 2 < 16 && config[ii] >= 0; ii += 3) {
+                            std::swap(config[ii + 1], config[ii + 2]);
+                        }
+                    }
+                }
+            }
+        };
+
+        inline auto marching_cubes_table() -> const MarchingCubesTable & {
+            static const MarchingCubesTable table;
+            return table;
+        }
+    }// namespace detail
+
+    /**
+     * Extracts the surface of a particle cloud as a triangle mesh with outward-facing triangles. Every particle
+     * adds a smooth kernel (1 - r^2 / radius^2)^3, scaled to integrate to its volume, to a density field, and
+     * marching cubes extracts the level `iso`.
+     *
+     * The density lives on a sparse grid of 8^3 voxel blocks that only covers the blocks within reach of a
+     * particle. The particles are sorted by block, then every block gathers the particles of its neighbours into
+     * its own samples and marches its own cells in parallel, so no two threads write the same memory. Vertices on
+     * block faces are welded afterwards by their global edge, which makes the mesh watertight.
+     */
+    inline auto reconstruct_surface(const std::vector<Vector<real, 3>> &x, const SurfaceSettings &settings,
+                                    int threads = 0) -> TriangleMesh {
+        constexpr int kBlock = 8;
+        constexpr int kSamples = kBlock + 1;
+        constexpr int64_t kBlockOffset = int64_t(1) << 20;
+        constexpr int64_t kEdgeOffset = int64_t(1) << 19;
+        constexpr std::size_t kParticleBlockSize = 1 << 16;
+
+        const real block_edge = kBlock * settings.spacing;
+        const int reach = int(std::ceil(settings.radius / block_edge));
+        const real radius = settings.radius / settings.spacing;
+        const real inv_radius2 = 1 / (radius * radius);
+
+        // The kernel integrates to 64 pi / 315 radius^3
+        const real weight = settings.particle_volume * 315 / (64 * real(M_PI) * std::pow(settings.radius, 3));
+
+        const auto block_key = [](const Vector<int64_t, 3> &b) -> uint64_t {
+            return uint64_t(b(0) + kBlockOffset) << 42 | uint64_t(b(1) + kBlockOffset) << 21 |
+                   uint64_t(b(2) + kBlockOffset);
+        };
+        const auto block_coord = [](uint64_t key) -> Vector<int64_t, 3> {
+            constexpr uint64_t kMask = (uint64_t(1) << 21) - 1;
+            return Vector<int64_t, 3>(int64_t(key >> 42 & kMask) - kBlockOffset,
+                                      int64_t(key >> 21 & kMask) - kBlockOffset, int64_t(key & kMask) - kBlockOffset);
+        };
+
+        // Particles sorted by block, non-finite ones are left out
+        std::vector<std::pair<uint64_t, uint32_t>> sorted(x.size());
+        parallel_blocks(x.size(), kParticleBlockSize, threads, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t pp = begin; pp < end; ++pp) {
+                if (!x[pp].allFinite()) {
+                    sorted[pp] = {~uint64_t(0), pp};
+                    continue;
+                }
+                sorted[pp] = {block_key((x[pp] / block_edge).array().floor().cast<int64_t>()), pp};
+            }
+        });
+        std::sort(sorted.begin(), sorted.end());
+        while (!sorted.empty() && sorted.back().first == ~uint64_t(0)) { sorted.pop_back(); }
+
+        // Positions in block order, so each block's gather reads contiguous memory
+        std::vector<Vector<real, 3>> positions(sorted.size());
+        parallel_blocks(sorted.size(), kParticleBlockSize, threads, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t ii = begin; ii < end; ++ii) { positions[ii] = x[sorted[ii].second]; }
+        });
+
+        // Blocks holding particles, with their ranges in `sorted`
+        std::vector<uint64_t> particle_blocks;
+        std::vector<std::size_t> particle_offsets;
+        for (std::size_t ii = 0; ii < sorted.size(); ++ii) {
+            if (ii == 0 || sorted[ii].first != sorted[ii - 1].first) {
+                particle_blocks.push_back(sorted[ii].first);
+                particle_offsets.push_back(ii);
+            }
+        }
+        particle_offsets.push_back(sorted.size());
+
+        // Every block a kernel can reach
+        std::vector<uint64_t> blocks;
+        blocks.reserve(particle_blocks.size() * (2 * reach + 1) * (2 * reach + 1) * (2 * reach + 1));
+        for (const auto key : particle_blocks) {
+            const auto b = block_coord(key);
+            for (int dx = -reach; dx <= reach; ++dx) {
+                for (int dy = -reach; dy <= reach; ++dy) {
+                    for (int dz = -reach; dz <= reach; ++dz) {
+                        blocks.push_back(block_key(b + Vector<int64_t, 3>(dx, dy, dz)));
+                    }
+                }
+            }
+        }
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+        struct BlockMesh {
+            // Vertices keyed by their global edge, and triangles referring to those keys
+            std::vector<std::pair<uint64_t, Vector<real, 3>>> vertices;
+            std::vector<std::array<uint64_t, 3>> triangles;
+        };
+        std::vector<BlockMesh> block_meshes(blocks.size());
+        const auto &table = detail::marching_cubes_table();
+
+        parallel_for(blocks.size(), threads, [&](int bb) {
+            const auto b = block_coord(blocks[bb]);
+            const Vector<int64_t, 3> base = b * kBlock;
+
+            std::array<real, kSamples * kSamples * kSamples> density{};
+
+            for (int dx = -reach; dx <= reach; ++dx) {
+                for (int dy = -reach; dy <= reach; ++dy) {
+                    for (int dz = -reach; dz <= reach; ++dz) {
+                        const auto key = block_key(b + Vector<int64_t, 3>(dx, dy, dz));
+                        const auto it = std::lower_bound(particle_blocks.begin(), particle_blocks.end(), key);
+                        if (it == particle_blocks.end() || *it != key) { continue; }
+                        const auto index = it - particle_blocks.begin();
+
+                        for (auto ii = particle_offsets[index]; ii < particle_offsets[index + 1]; ++ii) {
+                            // In sample units relative to this block
+                            const Vector<real, 3> p = positions[ii] / settings.spacing - base.cast<real>();
+                            if ((p.array() <= -radius).any() || (p.array() >= kBlock + radius).any()) { continue; }
+                            int lo[3], hi[3];
+                            for (int dd = 0; dd < 3; ++dd) {
+                                lo[dd] = std::max(int(std::ceil(p(dd) - radius)), 0);
+                                hi[dd] = std::min(int(std::floor(p(dd) + radius)), kBlock);
+                            }
+                            for (int ix = lo[0]; ix <= hi[0]; ++ix) {
+                                const real rx2 = (ix - p(0)) * (ix - p(0));
+                                for (int iy = lo[1]; iy <= hi[1]; ++iy) {
+                                    const real rxy2 = rx2 + (iy - p(1)) * (iy - p(1));
+                                    real *row = &density[(ix * kSamples + iy) * kSamples];
+                                    for (int iz = lo[2]; iz <= hi[2]; ++iz) {
+                                        const real w = std::max(1 - (rxy2 + (iz - p(2)) * (iz - p(2))) * inv_radius2,
+                                                                real(0));
+                                        row[iz] += weight * w * w * w;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            auto &out = block_meshes[bb];
+            std::array<uint64_t, 12> edge_keys;
+            for (int ix = 0; ix < kBlock; ++ix) {
+                for (int iy = 0; iy < kBlock; ++iy) {
+                    for (int iz = 0; iz < kBlock; ++iz) {
+                        real corners[8];
+                        int config = 0;
+                        for (int c = 0; c < 8; ++c) {
+                            const int sx = ix + (c & 1), sy = iy + ((c >> 1) & 1), sz = iz + ((c >> 2) & 1);
+                            corners[c] = density[(sx * kSamples + sy) * kSamples + sz];
+                            if (corners[c] > settings.iso) { config |= 1 << c; }
+                        }
+                        const auto &triangles = table.triangles[config];
+                        if (triangles[0] < 0) { continue; }
+
+                        edge_keys.fill(0);
+                        for (int tt = 0; tt < 16 && triangles[tt] >= 0; ++tt) {
+                            const int ee = triangles[tt];
+                            if (edge_keys[ee] == 0) {
+                                const int c0 = table.edges[ee][0], c1 = table.edges[ee][1];
+                                const Vector<int64_t, 3> g =
+                                        base + Vector<int64_t, 3>(ix + (c0 & 1), iy + ((c0 >> 1) & 1),
+                                                                  iz + ((c0 >> 2) & 1));
+                                edge_keys[ee] = uint64_t(g(0) + kEdgeOffset) << 42 |
+                                                uint64_t(g(1) + kEdgeOffset) << 22 |
+                                                uint64_t(g(2) + kEdgeOffset) << 2 | uint64_t(ee / 4);
+
+                                const real t = (settings.iso - corners[c0]) / (corners[c1] - corners[c0]);
+                                Vector<real, 3> position = g.cast<real>() * settings.spacing;
+                                position(ee / 4) += t * settings.spacing;
+                                out.vertices.emplace_back(edge_keys[ee], position);
+                            }
+                        }
+                        for (int tt = 0; tt < 16 && triangles[tt] >= 0; tt += 3) {
+                            out.triangles.push_back({edge_keys[triangles[tt]], edge_keys[triangles[tt + 1]],
+                                                     edge_keys[triangles[tt + 2]]});
+                        }
+                    }
+                }
+            }
+        });
+
+        // Weld the vertices shared between cells and blocks
+        std::vector<std::pair<uint64_t, Vector<real, 3>>> vertices;
+        std::vector<std::size_t> triangle_offsets{0};
+        for (const auto &block : block_meshes) {
+            vertices.insert(vertices.end(), block.vertices.begin(), block.vertices.end());
+            triangle_offsets.push_back(triangle_offsets.back() + block.triangles.size());
+        }
+        std::sort(vertices.begin(), vertices.end(),
+                  [](const auto &a, const auto &b) -> bool { return a.first < b.first; });
+        vertices.erase(std::unique(vertices.begin(), vertices.end(),
+                                   [](const auto &a, const auto &b) -> bool { return a.first == b.first; }),
+                       vertices.end());
+
+        TriangleMesh mesh;
+        mesh.vertices.resize(vertices.size());
+        mesh.faces.resize(triangle_offsets.back());
+        parallel_blocks(vertices.size(), kParticleBlockSize, threads, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t vv = begin; vv < end; ++vv) { mesh.vertices[vv] = vertices[vv].second; }
+        });
+        parallel_for(block_meshes.size(), threads, [&](int bb) {
+            const auto &triangles = block_meshes[bb].triangles;
+            for (std::size_t tt = 0; tt < triangles.size(); ++tt) {
+                for (int kk = 0; kk < 3; ++kk) {
+                    const auto it = std::lower_bound(
+                            vertices.begin(), vertices.end(), triangles[tt][kk],
+                            [](const auto &vertex, uint64_t key) -> bool { return vertex.first < key; });
+                    mesh.faces[triangle_offsets[bb] + tt](kk) = int(it - vertices.begin());
+                }
+            }
+        });
+        return mesh;
+    }
+}// namespace nclr
@@ -1,10 +1,20 @@
 #include "nclr.h"
+#include "nclr_async.h"
+#include "nclr_batched.h"
+#include "nclr_render.h"
+#include "nclr_scene.h"
 #include <cstdint>
 #include <filesystem>
 #include <flags.h>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <thread>
 #ifdef NCLR_SOLVER_VIZ
 #include "taichi.h"
 #endif
@@ -16,11 +26,8 @@ constexpr int kWindowSize = 800;
 // The color to paint the points
 constexpr int kColor = 0xED553B;
 
-// The MPM Grid Resolution (Change at your own risk!)
-constexpr int kGridResolution = 64;
-
-// The MPM Timestep (Change at your own risk!)
-constexpr nclr::real kDt = 1e-4;
+// How many ensemble members share one batched simulation with --batched
+constexpr int kBatchLanes = 8;
 
 auto help_msg() -> void {
     std::cout << "Usage: ./nuclear_mpm_solver [OPTIONS] COMMAND [ARGS]..." << std::endl;
@@ -29,189 +36,568 @@ auto help_msg() -> void {
     std::cout << "\t--steps\tINTEGER\t[default:1000]\tThe number of simulation steps" << std::endl;
     std::cout << "\t--cubes\tINTEGER\t[default:1]\tThe number of cubes to add" << std::endl;
     std::cout << "\t--cube-res\tINTEGER\t[default:25]\tThe resolution of each cube" << std::endl;
+    std::cout << "\t--cube-size\tFLOAT\t[default:0.2]\tThe side length of each cube" << std::endl;
     std::cout << "\t--dim\tINTEGER\t[default:2]\tThe number of dimensions to run the sim in [2d or 3d only!]"
               << std::endl;
+    std::cout << "\t--res\tINTEGER\t[default:64]\tThe number of grid cells along each axis" << std::endl;
+    std::cout << "\t--dt\tFLOAT\t[default:1e-4]\tThe simulation timestep" << std::endl;
+    std::cout << "\t--extent\tFLOAT\t[default:1.0]\tThe side length of the simulation domain" << std::endl;
     std::cout << "\t--E\tFLOAT\t[default:1000.0]\tThe young's modulus of the shape(s)" << std::endl;
     std::cout << "\t--nu\tFLOAT\t[default:0.3]\tThe poisson's ratio of the shape(s)" << std::endl;
     std::cout << "\t--gravity\tFLOAT\t[default:-9.8]\tThe gravitational forces" << std::endl;
     std::cout << "\t--material-model\t[jelly, snow, liquid]\t[default:jelly]\tThe material model to use" << std::endl;
     std::cout
-            << "\t--cube[n]-[xyz]\t\tEach cube gets its own position, this _must_ be explicitly set (0.1-0.9 for each)"
+            << "\t--cube[n]-[xyz]\t\tEach cube gets its own center, this _must_ be explicitly set (0.1-0.9 for each)"
             << std::endl;
+    std::cout << "\t\t\t\t--cube[n]-z is only read when --dim is 3" << std::endl;
     std::cout << "\t--dump\tDump particle state at each timestep (impacts perforamnce)" << std::endl;
+    std::cout << "\t--ensemble\tFILE\tRun every line of a sweep file (E nu gravity material-model) as its own "
+                 "simulation, dumping member n to tmp/ensemble_n"
+              << std::endl;
+    std::cout << "\t--batched\tRun ensemble members " << kBatchLanes
+              << " at a time, one per SIMD lane (best for many small scenes)" << std::endl;
+    std::cout << "\t--scene\tFILE\tLoad the whole scene (emitters, material, colliders, output) from a JSON file"
+              << std::endl;
+    std::cout << "\t--threads\tINTEGER\t[default:all cores]\tThe number of ensemble members to run at once, "
+                 "batches with --batched split the spare threads"
+              << std::endl;
+    std::cout << "\t--escape\t[clamp, delete, count]\t[default:clamp]\tWhat to do with particles that leave the domain"
+                 " (--batched always clamps)"
+              << std::endl;
     std::cout << "\t--help\tShow this message and exit" << std::endl;
 }
 
 template<int dim, typename Sim>
 auto solve_mpm(const Sim &sim, int steps, bool dump, std::vector<std::vector<nclr::Particle<dim>>> &states,
+               std::vector<std::vector<nclr::Matrix<nclr::real, dim>>> &deformations,
                std::vector<std::vector<nclr::Cell<dim>>> &cells) -> void {
     std::cout << "Running simulation" << std::endl;
-    for (int step = 0; step < steps; ++step) {
-        if (dump) {
-            states.push_back(sim->particles());
-            if (step > 0) {
-                cells.push_back(sim->grid());
-            } else {
-                cells.push_back(
-                        std::vector<nclr::Cell<dim>>((kGridResolution + 1) * (kGridResolution + 1), nclr::Cell<dim>()));
-            }
+    sim->advance(steps, dump ? 1 : 0, [&](int step, const auto &state) -> void {
+        states.push_back(state.particles());
+        deformations.push_back(state.deformations());
+        if (step > 0) {
+            cells.push_back(state.grid());
+        } else {
+            cells.push_back(std::vector<nclr::Cell<dim>>(state.grid_size(), nclr::Cell<dim>()));
         }
-        sim->advance();
-    }
+    });
     std::cout << "Simulation done" << std::endl;
 }
 
 auto exe_path() -> fs::path { return fs::canonical("."); }
 
-template<typename T>
-auto save_value(const T &value, const std::string &filename) -> void {
-    const fs::path full_path = exe_path() / fs::path("tmp") / fs::path(filename);
+auto open_output(const std::string &filename, const fs::path &dir) -> std::ofstream {
+    const fs::path full_path = exe_path() / dir / fs::path(filename);
     if (!fs::exists(full_path)) { fs::create_directories(fs::path(full_path.parent_path())); }
-    std::ofstream ofs(full_path, std::fstream::in | std::fstream::out | std::fstream::app);
-    ofs << value << std::endl;
-    ofs.close();
+    return std::ofstream(full_path, std::fstream::in | std::fstream::out | std::fstream::app);
+}
+
+// exe_path() / dir / "<prefix>_<step>.<extension>" with the step zero padded so that the files sort in order
+auto numbered_output(const fs::path &dir, const std::string &prefix, int step, const std::string &extension)
+        -> fs::path {
+    std::ostringstream name;
+    name << prefix << "_" << std::setw(6) << std::setfill('0') << step << "." << extension;
+    const fs::path path = exe_path() / dir / name.str();
+    fs::create_directories(path.parent_path());
+    return path;
+}
+
+// deformations is empty for liquids, which don't track F, and their F is written as the identity
+template<int dim>
+auto save_particles(const std::string &material_model, nclr::real mu_0, nclr::real lambda_0, nclr::real dt, int step,
+                    const std::vector<nclr::Particle<dim>> &p_list,
+                    const std::vector<nclr::Matrix<nclr::real, dim>> &deformations, const fs::path &dir = "tmp")
+        -> void {
+    const std::string prefix = std::to_string(step) + "_";
+    auto timestep_ofs = open_output(prefix + "timestep.txt", dir);
+    auto x_ofs = open_output(prefix + "x.txt", dir);
+    auto v_ofs = open_output(prefix + "v.txt", dir);
+    auto F_ofs = open_output(prefix + "F.txt", dir);
+    auto C_ofs = open_output(prefix + "C.txt", dir);
+    auto Jp_ofs = open_output(prefix + "Jp.txt", dir);
+    auto lame_ofs = open_output(prefix + "lame.txt", dir);
+
+    const auto timestep = step > 0 ? dt * step : dt;
+    const auto e = material_model == "snow"    ? nclr::MPMSimulation<dim>::kSnowHardening
+                   : material_model == "jelly" ? nclr::MPMSimulation<dim>::kJellyHardening
+                                               : nclr::MPMSimulation<dim>::kLiquidHardening;
+    const auto mu = mu_0 * e;
+    const auto lambda = lambda_0 * e;
+
+    for (std::size_t pp = 0; pp < p_list.size(); ++pp) {
+        const auto &p = p_list[pp];
+        timestep_ofs << timestep << std::endl;
+        x_ofs << p.x << std::endl;
+        v_ofs << p.v << std::endl;
+        F_ofs << (deformations.empty() ? nclr::diag<dim>(1) : deformations[pp]) << std::endl;
+        C_ofs << p.C << std::endl;
+        Jp_ofs << p.Jp << std::endl;
+        lame_ofs << nclr::Vector<nclr::real, 2>(mu, lambda).transpose() << std::endl;
+    }
+}
+
+template<int dim>
+auto save_cells(int step, const std::vector<nclr::Cell<dim>> &grid_state, const fs::path &dir = "tmp") -> void {
+    const std::string prefix = std::to_string(step) + "_";
+    auto mass_ofs = open_output(prefix + "mass.txt", dir);
+    auto velocity_ofs = open_output(prefix + "velocity.txt", dir);
+
+    // Cells are stored row-major (x slowest), so a linear walk matches the [x][y](z) dump order
+    for (int index = 0; index < grid_state.size(); ++index) {
+        mass_ofs << grid_state.at(index).mass << std::endl;
+        velocity_ofs << grid_state.at(index).velocity << std::endl;
+    }
 }
 
 template<int dim, typename Sim>
 auto unload_particles(const std::string material_model, const Sim &sim,
-                      const std::vector<std::vector<nclr::Particle<dim>>> &particles) -> void {
+                      const std::vector<std::vector<nclr::Particle<dim>>> &particles,
+                      const std::vector<std::vector<nclr::Matrix<nclr::real, dim>>> &deformations) -> void {
     std::cout << "Saving results" << std::endl;
-    const std::string timestep_filename = "timestep.txt";
-    const std::string x_filename = "x.txt";
-    const std::string v_filename = "v.txt";
-    const std::string F_filename = "F.txt";
-    const std::string C_filename = "C.txt";
-    const std::string Jp_filename = "Jp.txt";
-    const std::string lame_filename = "lame.txt";
-
-    int step = 0;
-    for (const auto &p_list : particles) {
-        const std::string prefix = std::to_string(step) + "_";
-        for (const auto &p : p_list) {
-            // Load the timestep
-            const auto timestep = step > 0 ? kDt * step : kDt;
-            save_value(timestep, prefix + timestep_filename);
-            save_value(p.x, prefix + x_filename);
-            save_value(p.v, prefix + v_filename);
-            save_value(p.F, prefix + F_filename);
-            save_value(p.C, prefix + C_filename);
-            save_value(p.Jp, prefix + Jp_filename);
-
-            const auto e = material_model == "snow"    ? sim->kSnowHardening
-                           : material_model == "jelly" ? sim->kJellyHardening
-                                                       : sim->kLiquidHardening;
-            const auto mu = sim->mu_0 * e;
-            const auto lambda = sim->lambda_0 * e;
-            save_value(nclr::Vector<nclr::real, 2>(mu, lambda).transpose(), prefix + lame_filename);
-        }
-        ++step;
+    for (int step = 0; step < particles.size(); ++step) {
+        save_particles<dim>(material_model, sim->mu_0, sim->lambda_0, sim->dt(), step, particles.at(step),
+                            deformations.at(step));
     }
     std::cout << "Done saving" << std::endl;
 }
 
 template<int dim, typename Sim>
 auto unload_cells(const Sim &sim, const std::vector<std::vector<nclr::Cell<dim>>> &cells) -> void {
-    const std::string mass_filename = "mass.txt";
-    const std::string velocity_filename = "velocity.txt";
-
-    const auto to_1d = [](int x, int y, int max) -> float { return (x * max) + y; };
     std::cout << "Saving grid states" << std::endl;
-    int step = 0;
-    for (const auto &grid_state : cells) {
-        const std::string prefix = std::to_string(step) + "_";
-        for (int ii = 0; ii <= kGridResolution; ++ii) {
-            for (int jj = 0; jj <= kGridResolution; ++jj) {
-                save_value(grid_state.at(to_1d(ii, jj, kGridResolution)).mass, prefix + mass_filename);
-                save_value(grid_state.at(to_1d(ii, jj, kGridResolution)).velocity, prefix + velocity_filename);
-            }
-        }
-        ++step;
-    }
+    for (int step = 0; step < cells.size(); ++step) { save_cells<dim>(step, cells.at(step)); }
     std::cout << "Done saving" << std::endl;
 }
 
 template<int dim>
-auto generate_cubes(const std::optional<int> &cubes, const std::optional<int> &cube_res, const flags::args &args)
+auto generate_cubes(const std::optional<int> &cubes, const std::optional<int> &cube_res,
+                    const std::optional<nclr::real> &cube_size, const flags::args &args)
         -> std::vector<nclr::Particle<dim>> {
+    constexpr char kAxes[] = {'x', 'y', 'z'};
+    const auto half_size = cube_size.value_or(0.2) / 2;
+
     auto particles = std::vector<nclr::Particle<dim>>{};
     for (int cc = 0; cc < cubes.value_or(1); ++cc) {
-        const auto cube_n_x = args.get<nclr::real>("cube" + std::to_string(cc) + "-x");
-        const auto cube_n_y = args.get<nclr::real>("cube" + std::to_string(cc) + "-y");
-        if (!cube_n_x || !cube_n_y) {
-            std::cerr << "Cube: " << cc << " is missing coordinates" << std::endl;
-            exit(EXIT_FAILURE);
+        nclr::Vector<nclr::real, dim> center;
+        for (int dd = 0; dd < dim; ++dd) {
+            const auto cube_n_d = args.get<nclr::real>("cube" + std::to_string(cc) + "-" + kAxes[dd]);
+            if (!cube_n_d) {
+                std::cerr << "Cube: " << cc << " is missing coordinate " << kAxes[dd] << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            center(dd) = cube_n_d.value();
         }
-        auto cube_particles = nclr::cube<dim>(cube_res.value_or(25), cube_n_x.value(), cube_n_y.value());
-        for (const auto &pos : cube_particles) { particles.emplace_back(nclr::Particle<dim>(pos, kColor)); }
+
+        const auto cube_particles = nclr::cube<dim>(cube_res.value_or(25), -half_size, half_size);
+        particles.reserve(particles.size() + cube_particles.size());
+        for (const auto &pos : cube_particles) { particles.emplace_back(nclr::Particle<dim>(pos + center, kColor)); }
     }
 
     return particles;
 }
 
+#ifdef NCLR_SOLVER_VIZ
+template<int dim>
+auto visualize(const std::vector<std::vector<nclr::Particle<dim>>> &states, const nclr::real extent) -> void {
+    taichi::GUI gui("Results", kWindowSize, kWindowSize);
+    auto &canvas = gui.get_canvas();
+    for (const auto &state : states) {
+        // Clear background
+        canvas.clear(0x112F41);
+
+        // Boundary Condition Box
+        canvas.rect(taichi::Vector2(0.04), taichi::Vector2(0.96)).radius(2).color(0x4FB99F).close();
+        for (const auto &particle : state) {
+            // Load the particle
+            if constexpr (dim == 3) {
+                const nclr::Vector<nclr::real, 2> pt = nclr::pt_3d_to_2d(particle.x / extent) / 4;
+                canvas.circle(taichi::Vector2(pt)).radius(2).color(particle.c);
+            } else {
+                const nclr::Vector<nclr::real, 2> pt = particle.x / extent;
+                canvas.circle(taichi::Vector2(pt)).radius(2).color(particle.c);
+            }
+        }
+
+        gui.update();
+    }
+}
+#endif
+
+auto to_material_model(const std::string &material_model) -> std::optional<nclr::MaterialModel> {
+    if (material_model == "jelly") { return nclr::MaterialModel::kJelly; }
+    if (material_model == "snow") { return nclr::MaterialModel::kSnow; }
+    if (material_model == "liquid") { return nclr::MaterialModel::kLiquid; }
+    return std::nullopt;
+}
+
+auto to_escape_policy(const std::string &escape) -> std::optional<nclr::EscapePolicy> {
+    if (escape == "clamp") { return nclr::EscapePolicy::kClamp; }
+    if (escape == "delete") { return nclr::EscapePolicy::kDelete; }
+    if (escape == "count") { return nclr::EscapePolicy::kCount; }
+    return std::nullopt;
+}
+
+template<int dim>
+auto report_escapes(const nclr::MPMSimulation<dim> &sim) -> void {
+    if (sim.escaped_particles() > 0) {
+        std::cout << sim.escaped_particles() << " particle(s) left the domain" << std::endl;
+    }
+}
+
+// One simulation of an ensemble sweep
+struct EnsembleMember {
+    nclr::real E;
+    nclr::real nu;
+    nclr::real gravity;
+    std::string material_model;
+};
+
+/**
+ * Reads a sweep file with one ensemble member per line, formatted as
+ * E nu gravity material-model
+ * Blank lines and lines starting with '#' are skipped.
+ */
+auto load_sweep(const std::string &filename) -> std::vector<EnsembleMember> {
+    std::ifstream ifs(filename);
+    if (!ifs.is_open()) {
+        std::cerr << "Could not open sweep file: " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<EnsembleMember> sweep;
+    std::string line;
+    for (int line_number = 1; std::getline(ifs, line); ++line_number) {
+        if (line.empty() || line.front() == '#') { continue; }
+
+        std::istringstream iss(line);
+        EnsembleMember member;
+        if (!(iss >> member.E >> member.nu >> member.gravity >> member.material_model) ||
+            !to_material_model(member.material_model)) {
+            std::cerr << "Invalid sweep entry on line " << line_number << ": " << line << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        sweep.push_back(member);
+    }
+
+    return sweep;
+}
+
+auto ensemble_dir(int member) -> fs::path { return fs::path("tmp") / ("ensemble_" + std::to_string(member)); }
+
+template<int dim>
+auto simulate_member(const flags::args &args, const std::vector<nclr::Particle<dim>> &particles, int member,
+                     const EnsembleMember &params) -> void {
+    const auto steps = args.get<int>("steps");
+    const auto res = args.get<int>("res");
+    const auto dt = args.get<nclr::real>("dt");
+    const auto extent = args.get<nclr::real>("extent");
+    const auto dump = args.get<bool>("dump", false);
+
+    const auto sim = std::make_unique<nclr::MPMSimulation<dim>>(
+            particles, to_material_model(params.material_model).value(), res.value_or(64), dt.value_or(1e-4),
+            params.E, params.nu, params.gravity, extent.value_or(1.0));
+    sim->set_escape_policy(to_escape_policy(args.get<std::string>("escape", "clamp")).value());
+    sim->set_threads(1);
+
+    sim->advance(steps.value_or(1000), dump ? 1 : 0, [&](int step, const auto &state) -> void {
+        save_particles<dim>(params.material_model, state.mu_0, state.lambda_0, state.dt(), step, state.particles(),
+                            state.deformations(), ensemble_dir(member));
+        save_cells<dim>(step,
+                        step > 0 ? state.grid()
+                                 : std::vector<nclr::Cell<dim>>(state.grid_size(), nclr::Cell<dim>()),
+                        ensemble_dir(member));
+    });
+}
+
+/**
+ * Runs up to kBatchLanes members starting at first_member in one BatchedMPMSimulation on `threads` threads. A short
+ * final batch is padded by repeating its last member, and the padding lanes are never dumped.
+ */
+template<int dim>
+auto simulate_batch(const flags::args &args, const std::vector<nclr::Particle<dim>> &particles, int first_member,
+                    const std::vector<EnsembleMember> &sweep, int threads) -> void {
+    const auto steps = args.get<int>("steps");
+    const auto res = args.get<int>("res");
+    const auto dt = args.get<nclr::real>("dt");
+    const auto extent = args.get<nclr::real>("extent");
+    const auto dump = args.get<bool>("dump", false);
+
+    const int lanes = std::min<int>(kBatchLanes, sweep.size() - first_member);
+    std::array<nclr::MaterialModel, kBatchLanes> models;
+    nclr::Lanes<kBatchLanes> E, nu, gravity;
+    for (int ll = 0; ll < kBatchLanes; ++ll) {
+        const auto &params = sweep.at(first_member + std::min(ll, lanes - 1));
+        models.at(ll) = to_material_model(params.material_model).value();
+        E(ll) = params.E;
+        nu(ll) = params.nu;
+        gravity(ll) = params.gravity;
+    }
+
+    const auto sim = std::make_unique<nclr::BatchedMPMSimulation<dim, kBatchLanes>>(
+            particles, models, res.value_or(64), dt.value_or(1e-4), E, nu, gravity, extent.value_or(1.0));
+    sim->set_threads(threads);
+
+    sim->advance(steps.value_or(1000), dump ? 1 : 0, [&](int step, const auto &state) -> void {
+        for (int ll = 0; ll < lanes; ++ll) {
+            const int member = first_member + ll;
+            save_particles<dim>(sweep.at(member).material_model, state.mu_0(ll), state.lambda_0(ll), state.dt(),
+                                step, state.particles(ll), state.deformations(ll), ensemble_dir(member));
+            save_cells<dim>(step,
+                            step > 0 ? state.grid(ll)
+                                     : std::vector<nclr::Cell<dim>>(state.grid_size(), nclr::Cell<dim>()),
+                            ensemble_dir(member));
+        }
+    });
+    if (sim->escaped_particles() > 0) {
+        std::cout << "Batch " << first_member / kBatchLanes << ": " << sim->escaped_particles()
+                  << " particle(s) left the domain" << std::endl;
+    }
+}
+
+/**
+ * Runs every member of the sweep as an independent simulation of the same cube scene. Members (or batches of
+ * members with --batched) are spread over a fixed pool of threads so long and short jobs balance out, and each
+ * member streams its dumps straight to its own directory instead of holding every state in memory.
+ */
+template<int dim>
+auto run_ensemble(const flags::args &args, const std::vector<EnsembleMember> &sweep) -> void {
+    const auto cubes = args.get<int>("cubes");
+    const auto cube_res = args.get<int>("cube-res");
+    const auto cube_size = args.get<nclr::real>("cube-size");
+    const auto threads = args.get<int>("threads");
+    const auto batched = args.get<bool>("batched", false);
+
+    const auto particles = generate_cubes<dim>(cubes, cube_res, cube_size, args);
+    const int jobs = batched ? (sweep.size() + kBatchLanes - 1) / kBatchLanes : sweep.size();
+
+    // Fewer batches than threads leaves cores idle, so the batches split the spare ones between them
+    const int workers = threads.value_or(0) > 0 ? threads.value() : int(std::thread::hardware_concurrency());
+    const int threads_per_batch = std::max(workers / std::max(jobs, 1), 1);
+
+    std::cout << "Running " << sweep.size() << " simulations" << std::endl;
+    std::mutex log_mutex;
+    nclr::parallel_for(jobs, threads.value_or(0), [&](int job) {
+        if (batched) {
+            simulate_batch<dim>(args, particles, job * kBatchLanes, sweep, threads_per_batch);
+        } else {
+            simulate_member<dim>(args, particles, job, sweep.at(job));
+        }
+
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cout << (batched ? "Batch " : "Simulation ") << job << " done" << std::endl;
+    });
+    std::cout << "Ensemble done" << std::endl;
+}
+
+template<int dim>
+auto run_scene(const nclr::json::Value &root) -> void {
+    const auto scene = nclr::load_scene<dim>(root);
+
+    std::cout << "Building scene" << std::endl;
+    auto sim = std::make_unique<nclr::MPMSimulation<dim>>(nclr::build_particles<dim>(scene), scene.model, scene.res,
+                                                          scene.dt, scene.E, scene.nu, scene.gravity, scene.extent);
+    for (const auto &collider : scene.colliders) { sim->add_collider(collider); }
+    for (const auto &source : scene.sources) { sim->add_source(source); }
+    for (const auto &sink : scene.sinks) { sim->add_sink(sink); }
+    sim->set_threads(scene.threads);
+    sim->set_escape_policy(scene.escape);
+    sim->set_sleeping(scene.sleep);
+    sim->set_adaptive(scene.adaptive);
+    sim->set_refinement(scene.refine);
+
+    const std::string material_model = scene.model == nclr::MaterialModel::kSnow    ? "snow"
+                                       : scene.model == nclr::MaterialModel::kJelly ? "jelly"
+                                                                                    : "liquid";
+
+    nclr::SplatRenderer<dim> renderer(scene.render_width, scene.render_height, scene.threads);
+    renderer.set_camera(scene.camera);
+    renderer.set_extent(scene.extent);
+    renderer.set_radius(scene.render_radius);
+
+    // Meshing gets its own copy of the positions, so it can run on the output thread
+    struct SurfaceJob {
+        int step;
+        std::vector<nclr::Vector<nclr::real, dim>> x;
+    };
+    const auto write_surface = [&](SurfaceJob &job) -> void {
+        if constexpr (dim == 3) {
+            nclr::save_mesh(nclr::reconstruct_surface(job.x, scene.surface, scene.threads),
+                            numbered_output(scene.surface_directory, "surface", job.step, scene.surface_format)
+                                    .string());
+        }
+    };
+    std::unique_ptr<nclr::AsyncWriter<SurfaceJob>> surface_writer;
+    if (scene.surface_every > 0 && scene.surface_async) {
+        surface_writer = std::make_unique<nclr::AsyncWriter<SurfaceJob>>(write_surface);
+    }
+
+    std::cout << "Running simulation with " << sim->particles().size() << " particles" << std::endl;
+    const int every = std::gcd(std::gcd(scene.output_every, scene.render_every),
+                               std::gcd(scene.fields_every, scene.surface_every));
+    sim->advance(scene.steps, every, [&](int step, const auto &state) -> void {
+        if (scene.output_every > 0 && step % scene.output_every == 0) {
+            save_particles<dim>(material_model, state.mu_0, state.lambda_0, state.dt(), step, state.particles(),
+                                state.deformations(), scene.output_directory);
+            save_cells<dim>(step,
+                            step > 0 ? state.grid()
+                                     : std::vector<nclr::Cell<dim>>(state.grid_size(), nclr::Cell<dim>()),
+                            scene.output_directory);
+        }
+        if (scene.render_every > 0 && step % scene.render_every == 0) {
+            nclr::save_ppm(renderer.render(state.particles()),
+                           numbered_output(scene.render_directory, "frame", step, "ppm").string());
+        }
+        if (scene.fields_every > 0 && step % scene.fields_every == 0) {
+            constexpr const char *kFieldNames[] = {"mass", "velocity", "jp"};
+            for (const auto &field : scene.fields) {
+                nclr::save_ppm(nclr::render_field(state, field, scene.threads),
+                               numbered_output(scene.fields_directory, kFieldNames[int(field.field)], step, "ppm")
+                                       .string());
+            }
+        }
+        if (scene.surface_every > 0 && step % scene.surface_every == 0) {
+            SurfaceJob job{step, std::vector<nclr::Vector<nclr::real, dim>>(state.particles().size())};
+            for (std::size_t pp = 0; pp < job.x.size(); ++pp) { job.x[pp] = state.particles()[pp].x; }
+            if (surface_writer) {
+                surface_writer->push(std::move(job));
+            } else {
+                write_surface(job);
+            }
+        }
+    });
+    // Waits for the queued meshes
+    surface_writer.reset();
+    std::cout << "Simulation done" << std::endl;
+    report_escapes(*sim);
+    if (scene.sleep.enabled) {
+        std::cout << sim->sleeping_particles() << " of " << sim->particles().size() << " particles are asleep"
+                  << std::endl;
+    }
+    if (scene.refine.enabled) {
+        std::cout << sim->refined_blocks() << " blocks are refined" << std::endl;
+    }
+    if (scene.adaptive.enabled) {
+        std::cout << sim->split_particles() << " splits and " << sim->merged_particles() << " merges, "
+                  << sim->particles().size() << " particles" << std::endl;
+    }
+}
+
+template<int dim>
+auto run(const flags::args &args, const nclr::MaterialModel model) -> void {
+    const auto steps = args.get<int>("steps");
+    const auto cubes = args.get<int>("cubes");
+    const auto cube_res = args.get<int>("cube-res");
+    const auto cube_size = args.get<nclr::real>("cube-size");
+    const auto res = args.get<int>("res");
+    const auto dt = args.get<nclr::real>("dt");
+    const auto extent = args.get<nclr::real>("extent");
+    const auto E = args.get<nclr::real>("E");
+    const auto nu = args.get<nclr::real>("nu");
+    const auto gravity = args.get<nclr::real>("gravity");
+    const auto material_model = args.get<std::string>("material-model");
+    const auto dump = args.get<bool>("dump", false);
+
+    const auto particles = generate_cubes<dim>(cubes, cube_res, cube_size, args);
+    auto sim = std::make_unique<nclr::MPMSimulation<dim>>(particles, model, res.value_or(64), dt.value_or(1e-4),
+                                                          E.value_or(1000.0), nu.value_or(0.3),
+                                                          gravity.value_or(-100.0), extent.value_or(1.0));
+    sim->set_escape_policy(to_escape_policy(args.get<std::string>("escape", "clamp")).value());
+    std::vector<std::vector<nclr::Particle<dim>>> states;
+    std::vector<std::vector<nclr::Matrix<nclr::real, dim>>> deformations;
+    std::vector<std::vector<nclr::Cell<dim>>> cells;
+    solve_mpm<dim>(sim, steps.value_or(1000), dump, states, deformations, cells);
+    report_escapes(*sim);
+#ifdef NCLR_SOLVER_VIZ
+    visualize<dim>(states, extent.value_or(1.0));
+#endif
+
+    if (dump) {
+        unload_particles<dim>(material_model.value_or("jelly"), sim, states, deformations);
+        unload_cells<dim>(sim, cells);
+    }
+}
+
 int main(int argc, char **argv) {
     const flags::args args(argc, argv);
     const auto steps = args.get<int>("steps");
     const auto cubes = args.get<int>("cubes");
     const auto cube_res = args.get<int>("cube-res");
+    const auto cube_size = args.get<nclr::real>("cube-size");
     const auto dim = args.get<int>("dim");
+    const auto res = args.get<int>("res");
+    const auto dt = args.get<nclr::real>("dt");
+    const auto extent = args.get<nclr::real>("extent");
     const auto E = args.get<nclr::real>("E");
     const auto nu = args.get<nclr::real>("nu");
     const auto gravity = args.get<nclr::real>("gravity");
     const auto material_model = args.get<std::string>("material-model");
-    const auto dump = args.get<bool>("dump", false);
+    const auto ensemble = args.get<std::string>("ensemble");
+    const auto scene = args.get<std::string>("scene");
+    const auto escape = args.get<std::string>("escape");
     const auto help = args.get<bool>("help", false);
 
-    if (material_model && material_model.value() != "jelly" && material_model.value() != "snow" &&
-        material_model.value() != "liquid") {
+    if (material_model && !to_material_model(material_model.value())) {
         std::cerr << "Invalid Option: " << material_model.value() << std::endl;
         help_msg();
         return EXIT_FAILURE;
     }
 
-    if (help || !steps && !cubes && !cube_res && !dim && !E && !nu && !gravity && !material_model) { help_msg(); }
+    if (escape && !to_escape_policy(escape.value())) {
+        std::cerr << "Invalid Option: --escape " << escape.value() << std::endl;
+        help_msg();
+        return EXIT_FAILURE;
+    }
+
+    // Batched lanes share one particle list, so they can only clamp
+    if (escape && escape.value() != "clamp" && args.get<bool>("batched", false)) {
+        std::cerr << "Invalid Option: --batched only supports --escape clamp" << std::endl;
+        help_msg();
+        return EXIT_FAILURE;
+    }
 
-    auto model = nclr::MaterialModel::kJelly;
-    if (material_model == "snow") {
-        model = nclr::MaterialModel::kSnow;
-    } else if (material_model == "liquid") {
-        model = nclr::MaterialModel::kLiquid;
+    if (help || !steps && !cubes && !cube_res && !cube_size && !dim && !res && !dt && !extent && !E && !nu &&
+                        !gravity && !material_model && !ensemble && !scene) {
+        help_msg();
     }
 
+    const auto model = to_material_model(material_model.value_or("jelly")).value();
 
-    // Ew
-    if (dim.value_or(2) == 2) {
-        const auto particles = generate_cubes<2>(cubes, cube_res, args);
-        auto sim = std::make_unique<nclr::MPMSimulation<2>>(particles, model, kGridResolution, kDt, E.value_or(1000.0),
-                                                            nu.value_or(0.3), gravity.value_or(-100.0));
-        std::vector<std::vector<nclr::Particle<2>>> states;
-        std::vector<std::vector<nclr::Cell<2>>> cells;
-        solve_mpm<2>(sim, steps.value_or(1000), dump, states, cells);
-#ifdef NCLR_SOLVER_VIZ
-        taichi::GUI gui("Results", kWindowSize, kWindowSize);
-        auto &canvas = gui.get_canvas();
-        for (const auto &state : states) {
-            // Clear background
-            canvas.clear(0x112F41);
-
-            // Boundary Condition Box
-            canvas.rect(taichi::Vector2(0.04), taichi::Vector2(0.96)).radius(2).color(0x4FB99F).close();
-            for (const auto &particle : state) {
-                // Load the particle
-                canvas.circle(taichi::Vector2(particle.x)).radius(2).color(particle.c);
-            }
+    if (res && res.value() <= 2 * nclr::MPMSimulation<2>::kBoundary || dt && dt.value() <= 0 ||
+        extent && extent.value() <= 0) {
+        std::cerr << "Invalid Option: --res must exceed the boundary layer, --dt and --extent must be positive"
+                  << std::endl;
+        help_msg();
+        return EXIT_FAILURE;
+    }
 
-            gui.update();
-        }
-#endif
+    if (dim && dim.value() != 2 && dim.value() != 3) {
+        std::cerr << "Invalid Option: --dim " << dim.value() << std::endl;
+        help_msg();
+        return EXIT_FAILURE;
+    }
 
-        if (dump) {
-            unload_particles<2>(material_model.value_or("jelly"), sim, states);
-            unload_cells<2>(sim, cells);
+    if (scene) {
+        try {
+            // Parse once, the dimension picks which scene type the document is loaded into
+            const auto root = nclr::json::parse_file(scene.value());
+            if (root.get("dim", 2.0) == 3) {
+                run_scene<3>(root);
+            } else {
+                run_scene<2>(root);
+            }
+        } catch (const std::runtime_error &e) {
+            std::cerr << "Invalid scene " << scene.value() << ": " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (ensemble) {
+        const auto sweep = load_sweep(ensemble.value());
+        if (dim.value_or(2) == 2) {
+            run_ensemble<2>(args, sweep);
+        } else {
+            run_ensemble<3>(args, sweep);
         }
+    } else if (dim.value_or(2) == 2) {
+        run<2>(args, model);
     } else {
-        auto particles = std::vector<nclr::Particle<3>>{};
-        auto sim = std::make_unique<nclr::MPMSimulation<3>>(particles, model, kGridResolution, kDt, E.value_or(1000.0),
-                                                            nu.value_or(0.3), gravity.value_or(-100.0));
-        /* const auto states = solve_mpm<3>(sim, steps.value_or(1000), dump); */
+        run<3>(args, model);
     }
 }
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "nclr.h"
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// Minimal checks for the test executables, a failed check is reported and turns the exit code into a failure
+namespace nclr::test {
+    inline int failures = 0;
+
+    inline auto check(const bool condition, const char *what, const char *file, const int line) -> void {
+        if (condition) { return; }
+        std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+        ++failures;
+    }
+
+    inline auto check_close(const double actual, const double expected, const double tolerance, const char *what,
+                            const char *file, const int line) -> void {
+        if (std::abs(actual - expected) <= tolerance) { return; }
+        std::cerr << file << ":" << line << ": " << what << " is " << actual << ", expected " << expected
+                  << " within " << tolerance << std::endl;
+        ++failures;
+    }
+
+    inline auto result() -> int { return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE; }
+
+    /**
+     * The cube<dim>() lattice of [lo, hi] with per_side points per side, spreading from the middle of the domain at
+     * `stretch` times the distance and spinning about it at `spin`, so that F and its rotation leave the identity.
+     */
+    template<int dim>
+    auto spinning_cube(const int per_side, const real lo, const real hi, const real stretch, const real spin)
+            -> std::vector<Particle<dim>> {
+        std::vector<Particle<dim>> particles;
+        for (const auto &x : cube<dim>(per_side, lo, hi)) {
+            Vector<real, dim> v = (x - constvec<dim>(0.5)) * stretch;
+            v(0) -= spin * (x(1) - 0.5);
+            v(1) += spin * (x(0) - 0.5);
+            particles.emplace_back(x, 0, v);
+        }
+        return particles;
+    }
+}// namespace nclr::test
+
+#define NCLR_CHECK(condition) nclr::test::check((condition), #condition, __FILE__, __LINE__)
+#define NCLR_CHECK_CLOSE(actual, expected, tolerance)                                                                  \
+    nclr::test::check_close((actual), (expected), (tolerance), #actual, __FILE__, __LINE__)
@@ -0,0 +1,66 @@
+#include "nclr_batched.h"
+#include "nclr_test.h"
+#include <array>
+#include <vector>
+
+namespace {
+    using namespace nclr;
+
+    constexpr int kLanes = 8;
+    constexpr int kSteps = 100;
+
+    // Largest position difference allowed between a lane and its scalar run, in domain lengths
+    constexpr real kTolerance = 1e-4;
+
+    // Largest Jp difference allowed, snow's clamped plasticity amplifies the rounding the most
+    constexpr real kJpTolerance = 5e-3;
+
+    /**
+     * Runs the same cube once batched, with a different material, E and gravity per lane, and once per lane with
+     * the scalar solver, and compares the particles after kSteps steps.
+     */
+    template<int dim>
+    auto check_lanes() -> void {
+        const auto particles = test::spinning_cube<dim>(dim == 2 ? 12 : 6, 0.4, 0.6, 5, 20);
+
+        std::array<MaterialModel, kLanes> models;
+        Lanes<kLanes> E, nu, gravity;
+        constexpr MaterialModel kModels[] = {MaterialModel::kJelly, MaterialModel::kSnow, MaterialModel::kLiquid};
+        for (int ll = 0; ll < kLanes; ++ll) {
+            models[ll] = kModels[ll % 3];
+            E(ll) = 1e3 * (ll + 1);
+            nu(ll) = 0.2 + 0.02 * ll;
+            gravity(ll) = -10.0 * ll;
+        }
+
+        constexpr int kRes = 32;
+        constexpr real kDt = 1e-4;
+        BatchedMPMSimulation<dim, kLanes> batched(particles, models, kRes, kDt, E, nu, gravity);
+        batched.set_threads(2);
+        for (int step = 0; step < kSteps; ++step) { batched.advance(); }
+
+        for (int ll = 0; ll < kLanes; ++ll) {
+            MPMSimulation<dim> scalar(particles, models[ll], kRes, kDt, E(ll), nu(ll), gravity(ll));
+            for (int step = 0; step < kSteps; ++step) { scalar.advance(); }
+
+            const auto lane = batched.particles(ll);
+            NCLR_CHECK(lane.size() == scalar.particles().size());
+            real error = 0, Jp_error = 0;
+            for (std::size_t pp = 0; pp < lane.size(); ++pp) {
+                error = std::max(error, (lane[pp].x - scalar.particles()[pp].x).cwiseAbs().maxCoeff());
+                Jp_error = std::max(Jp_error, std::abs(lane[pp].Jp - scalar.particles()[pp].Jp));
+            }
+            NCLR_CHECK_CLOSE(error, 0, kTolerance);
+            NCLR_CHECK_CLOSE(Jp_error, 0, kJpTolerance);
+
+            // Lanes carry F like the scalar solver, none for liquids
+            NCLR_CHECK(batched.deformations(ll).size() == scalar.deformations().size());
+        }
+    }
+}// namespace
+
+int main() {
+    check_lanes<2>();
+    check_lanes<3>();
+    return nclr::test::result();
+}
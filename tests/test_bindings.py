@@ -0,0 +1,66 @@
+"""Smoke test of the nuclear_mpm module: stepping and the in-place particle and grid views."""
+import numpy as np
+
+import nuclear_mpm
+
+
+def main():
+    rng = np.random.default_rng(0)
+    x = rng.uniform(0.4, 0.6, size=(500, 2)).astype(np.float32)
+    sim = nuclear_mpm.MPMSimulation2D(x, model=nuclear_mpm.MaterialModel.jelly, res=32, E=1000, nu=0.3)
+    assert sim.num_particles == 500
+    assert np.allclose(sim.x, x)
+    assert sim.F.shape == (500, 2, 2) and sim.C.shape == (500, 2, 2) and sim.Jp.shape == (500,)
+
+    # The grid view is refreshed in place by every step
+    sim.advance(1)
+    grid_mass = sim.grid_mass
+    assert grid_mass.shape == (33, 33) and not grid_mass.flags.writeable
+    before = grid_mass.sum()
+    assert abs(before - 500) < 1e-2
+    sim.advance(5)
+    assert np.shares_memory(grid_mass, sim.grid_mass)
+
+    # Particle properties are read-only views of the simulation's storage, not copies
+    x_view, F_view, Jp_view = sim.x, sim.F, sim.Jp
+    for view in (x_view, sim.v, F_view, sim.C, Jp_view):
+        assert view.base is sim and not view.flags.writeable
+    assert np.shares_memory(x_view, sim.x) and np.shares_memory(F_view, sim.F)
+    try:
+        x_view[0, 0] = 0
+        raise AssertionError("particle views must be read-only")
+    except ValueError:
+        pass
+
+    # A step that keeps the particle count updates the views in place
+    before = x_view.copy()
+    sim.advance(1)
+    assert sim.num_particles == 500 and np.shares_memory(x_view, sim.x)
+    assert not np.array_equal(x_view, before)
+    assert np.array_equal(x_view, sim.x) and np.array_equal(Jp_view, sim.Jp)
+
+    # Splitting reallocates the particle storage, fresh views see the new particles
+    adaptive = nuclear_mpm.AdaptiveSettings()
+    adaptive.enabled = True
+    adaptive.every = 1
+    sim.set_adaptive(adaptive)
+    sim.advance(3)
+    assert sim.split_particles > 0 and sim.num_particles > 500
+    assert sim.x.shape == (sim.num_particles, 2) and sim.F.shape == (sim.num_particles, 2, 2)
+
+    # The callback runs between steps, where copies of the views are consistent
+    steps, copies = [], []
+    sim.advance(10, 4, lambda step: (steps.append(step), copies.append(np.array(sim.x))))
+    assert steps == [0, 4, 8, 10], steps
+    assert np.array_equal(copies[-1], sim.x) and not np.array_equal(copies[0], copies[-1])
+
+    # Liquids don't track F, it reads as the identity
+    liquid = nuclear_mpm.MPMSimulation2D(x, model=nuclear_mpm.MaterialModel.liquid, res=32, E=1000, nu=0.3)
+    liquid.advance(20)
+    assert np.array_equal(liquid.F, np.broadcast_to(np.eye(2, dtype=np.float32), (500, 2, 2)))
+    assert not np.allclose(liquid.Jp, 1)
+
+
+if __name__ == "__main__":
+    main()
+    print("ok")
@@ -0,0 +1,87 @@
+#include "nclr_batched.h"
+#include "nclr_test.h"
+#include <array>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+    using namespace nclr;
+
+    // A source that straddles the wall and particles added outside the domain must not reach p2g() off the grid
+    auto check_insertion(const EscapePolicy policy) -> void {
+        std::vector<Particle<2>> particles;
+        for (const auto &x : cube<2>(8, 0.45, 0.55)) { particles.emplace_back(x, 0); }
+        MPMSimulation<2> sim(particles, MaterialModel::kJelly, 32);
+        sim.set_escape_policy(policy);
+        sim.add_source(Source<2>{Vector<real, 2>(0.99, 0.5), constvec<2>(0.05), constvec<2>(0), 16, 0});
+        sim.add_particles({Particle<2>(Vector<real, 2>(1.5, 0.5), 0), Particle<2>(Vector<real, 2>(-0.2, 2.0), 0)});
+
+        bool threw = false;
+        try {
+            for (int step = 0; step < 10; ++step) { sim.advance(); }
+        } catch (const std::out_of_range &) { threw = true; }
+        NCLR_CHECK(!threw);
+        NCLR_CHECK(sim.escaped_particles() > 0);
+
+        const real lo = sim.dx(), hi = (sim.res() - 1) * sim.dx();
+        for (const auto &p : sim.particles()) {
+            const bool inside = (p.x.array() >= lo).all() && (p.x.array() <= hi).all();
+            if (policy != EscapePolicy::kCount) { NCLR_CHECK(inside); }
+        }
+    }
+
+    // Splitting a particle on the wall must not push either half out, so kDelete loses no mass
+    auto check_split_at_wall() -> void {
+        constexpr int kRes = 32;
+        std::vector<Particle<2>> particles;
+        for (int ii = 0; ii < 8; ++ii) { particles.emplace_back(Vector<real, 2>(1.0 / kRes, 0.4 + 0.01 * ii), 0); }
+        MPMSimulation<2> sim(particles, MaterialModel::kJelly, kRes);
+        sim.set_escape_policy(EscapePolicy::kDelete);
+        AdaptiveSettings adaptive;
+        adaptive.enabled = true;
+        adaptive.every = 1;
+        adaptive.split_levels = 2;
+        sim.set_adaptive(adaptive);
+
+        bool threw = false;
+        try {
+            for (int step = 0; step < 4; ++step) { sim.advance(); }
+        } catch (const std::out_of_range &) { threw = true; }
+        NCLR_CHECK(!threw);
+        NCLR_CHECK(sim.split_particles() > 0);
+        NCLR_CHECK(sim.escaped_particles() == 0);
+
+        real mass = 0;
+        for (const auto &p : sim.particles()) { mass += p.mass; }
+        NCLR_CHECK_CLOSE(mass, real(particles.size()), 1e-9);
+    }
+
+    // Batched lanes clamp, including lanes that leave the domain while others don't
+    auto check_batched() -> void {
+        std::vector<Particle<2>> particles;
+        for (const auto &x : cube<2>(8, 0.45, 0.55)) { particles.emplace_back(x, 0, Vector<real, 2>(0, 0)); }
+        particles.emplace_back(Vector<real, 2>(1.2, 0.5), 0);
+
+        std::array<MaterialModel, 4> models{};
+        models.fill(MaterialModel::kJelly);
+        const Lanes<4> E = Lanes<4>::Constant(1e3), nu = Lanes<4>::Constant(0.3);
+        const Lanes<4> gravity(-100, -1e4, -1e5, 0);
+        BatchedMPMSimulation<2, 4> sim(particles, models, 32, 1e-3, E, nu, gravity);
+
+        bool threw = false;
+        try {
+            for (int step = 0; step < 50; ++step) { sim.advance(); }
+        } catch (const std::out_of_range &) { threw = true; }
+        NCLR_CHECK(!threw);
+        NCLR_CHECK(sim.escaped_particles() > 0);
+    }
+}// namespace
+
+int main() {
+    check_insertion(nclr::EscapePolicy::kClamp);
+    check_insertion(nclr::EscapePolicy::kDelete);
+    check_insertion(nclr::EscapePolicy::kCount);
+    check_split_at_wall();
+    check_batched();
+    return nclr::test::result();
+}
@@ -0,0 +1,101 @@
+#include "nclr.h"
+#include "nclr_test.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+    using namespace nclr;
+
+    // Per-particle g2p() gather of v and C from the coarse grid, the reference for the lane-wise gather()
+    template<int dim>
+    auto scalar_gather(const MPMSimulation<dim> &sim, const Vector<real, dim> &x, Vector<real, dim> &v,
+                       Matrix<real, dim> &C) -> void {
+        const real inv_dx = 1 / sim.dx();
+        const Vector<int, dim> base_coord = (x * inv_dx - constvec<dim>(0.5)).template cast<int>();
+        const Vector<real, dim> fx = x * inv_dx - base_coord.template cast<real>();
+        const std::array<Vector<real, dim>, 3> w{
+                constvec<dim>(0.5).cwiseProduct(Eigen::square((constvec<dim>(1.5) - fx).array()).matrix()),
+                constvec<dim>(0.75) - Eigen::square((fx - constvec<dim>(1.0)).array()).matrix(),
+                constvec<dim>(0.5).cwiseProduct(Eigen::square((fx - constvec<dim>(0.5)).array()).matrix())};
+
+        v.setZero();
+        C.setZero();
+        int nodes = 1;
+        for (int dd = 0; dd < dim; ++dd) { nodes *= 3; }
+        for (int nn = 0; nn < nodes; ++nn) {
+            Vector<int, dim> offset;
+            for (int dd = dim - 1, rest = nn; dd >= 0; --dd, rest /= 3) { offset[dd] = rest % 3; }
+
+            real weight = 1;
+            int index = 0;
+            for (int dd = 0; dd < dim; ++dd) {
+                weight *= w[offset[dd]][dd];
+                index = index * (sim.res() + 1) + base_coord[dd] + offset[dd];
+            }
+            const Vector<real, dim> momentum = weight * sim.grid()[index].velocity;
+            v += momentum;
+            C += 4 * inv_dx * momentum * (offset.template cast<real>() - fx).transpose();
+        }
+    }
+
+    /**
+     * The particle count is not a multiple of kGatherLanes, so the last batch is a partial one, and the refined
+     * surface blocks put fine, blended and coarse particles into the same batches. Every particle without a fine
+     * share has to come out of the lane-wise gather as it would from the per-particle one.
+     */
+    template<int dim>
+    auto check_gather() -> void {
+        constexpr int kLanes = MPMSimulation<dim>::kGatherLanes;
+        const auto particles = test::spinning_cube<dim>(dim == 2 ? 37 : 17, 0.3, 0.7, 5, 20);
+        NCLR_CHECK(particles.size() % kLanes != 0);
+
+        MPMSimulation<dim> sim(particles, MaterialModel::kJelly, 32);
+        RefineSettings refine;
+        refine.enabled = true;
+        refine.every = 1;
+        refine.strain = 1;
+        sim.set_refinement(refine);
+        for (int step = 0; step < 5; ++step) { sim.advance(); }
+
+        const std::vector<Particle<dim>> before = sim.particles();
+        sim.advance();
+        NCLR_CHECK(sim.refined_blocks() > 0);
+        NCLR_CHECK(sim.particles().size() == before.size());
+
+        int mixed = 0, coarse = 0;
+        real v_error = 0, C_error = 0, v_scale = 0, C_scale = 0;
+        for (std::size_t begin = 0; begin < before.size(); begin += kLanes) {
+            const std::size_t end = std::min(before.size(), begin + kLanes);
+            bool any_fine = false, any_coarse = false;
+            for (std::size_t pp = begin; pp < end; ++pp) {
+                if (sim.fine_share(before[pp].x) > 0) {
+                    any_fine = true;
+                    continue;
+                }
+                any_coarse = true;
+                ++coarse;
+
+                Vector<real, dim> v;
+                Matrix<real, dim> C;
+                scalar_gather(sim, before[pp].x, v, C);
+                const auto &p = sim.particles()[pp];
+                v_error = std::max(v_error, (p.v - v).cwiseAbs().maxCoeff());
+                C_error = std::max(C_error, (p.C - C).cwiseAbs().maxCoeff());
+                v_scale = std::max(v_scale, v.cwiseAbs().maxCoeff());
+                C_scale = std::max(C_scale, C.cwiseAbs().maxCoeff());
+            }
+            mixed += any_fine && any_coarse;
+        }
+        NCLR_CHECK(mixed > 0);
+        NCLR_CHECK(coarse > 0);
+        NCLR_CHECK(v_scale > 0 && C_scale > 0);
+        NCLR_CHECK_CLOSE(v_error / v_scale, 0, 1e-5);
+        NCLR_CHECK_CLOSE(C_error / C_scale, 0, 1e-5);
+    }
+}// namespace
+
+int main() {
+    check_gather<2>();
+    check_gather<3>();
+    return nclr::test::result();
+}
@@ -0,0 +1,50 @@
+#include "nclr.h"
+#include "nclr_test.h"
+#include <atomic>
+#include <vector>
+
+namespace {
+    using namespace nclr;
+
+    // Every index runs exactly once per job, the pool is reused across jobs, and nested jobs don't deadlock
+    auto check_pool() -> void {
+        WorkerPool pool(4);
+        NCLR_CHECK(pool.size() == 4);
+        for (int job = 0; job < 200; ++job) {
+            const int n = 1 + job * 7 % 97;
+            std::vector<std::atomic<int>> hits(n);
+            parallel_for(n, pool, [&](int ii) {
+                ++hits[ii];
+                parallel_for(3, pool, [&](int) { ++hits[ii]; });
+            });
+            for (const auto &hit : hits) { NCLR_CHECK(hit == 4); }
+        }
+
+        std::atomic<std::size_t> total = 0;
+        parallel_blocks(10000, 64, pool, [&](std::size_t begin, std::size_t end) { total += end - begin; });
+        NCLR_CHECK(total == 10000);
+    }
+
+    // The callback sees the state on entry, every callback_every steps, and the final state
+    auto check_callback() -> void {
+        std::vector<Particle<2>> particles;
+        for (const auto &x : cube<2>(8, 0.4, 0.6)) { particles.emplace_back(x, 0); }
+        MPMSimulation<2> sim(particles, MaterialModel::kJelly, 32);
+        sim.set_threads(3);
+
+        std::vector<int> steps;
+        sim.advance(10, 4, [&](int step, const MPMSimulation<2> &) { steps.push_back(step); });
+        NCLR_CHECK((steps == std::vector<int>{0, 4, 8, 10}));
+        NCLR_CHECK(sim.steps() == 10);
+
+        steps.clear();
+        sim.advance(8, 4, [&](int step, const MPMSimulation<2> &) { steps.push_back(step); });
+        NCLR_CHECK((steps == std::vector<int>{0, 4, 8}));
+    }
+}// namespace
+
+int main() {
+    check_pool();
+    check_callback();
+    return nclr::test::result();
+}
@@ -0,0 +1,71 @@
+#include "nclr.h"
+#include "nclr_test.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+    using namespace nclr;
+
+    /**
+     * The rotations kept beside the particles have to stay in step with them through emission, escapes, sinks,
+     * splits and merges, and match a fresh polar decomposition of F up to rounding (snow takes them from its SVD,
+     * jelly refines last step's).
+     */
+    template<int dim>
+    auto check_rotations(const MaterialModel model) -> void {
+        auto particles = test::spinning_cube<dim>(dim == 2 ? 16 : 8, 0.4, 0.6, 10, 30);
+        // Outside the domain, so deleted as soon as the policy is set
+        Vector<real, dim> away = constvec<dim>(0.5);
+        away(0) = 1.2;
+        particles.emplace_back(away, 0);
+
+        MPMSimulation<dim> sim(particles, model, 32);
+        sim.set_escape_policy(EscapePolicy::kDelete);
+        Vector<real, dim> source = constvec<dim>(0.5);
+        source(1) = 0.8;
+        sim.add_source(Source<dim>{source, constvec<dim>(0.02), constvec<dim>(0), 2, 0});
+        Vector<real, dim> up = constvec<dim>(0);
+        up(1) = 1;
+        sim.add_sink(Sink<dim>(ColliderShape::kPlane, constvec<dim>(0.3), up));
+
+        AdaptiveSettings adaptive;
+        adaptive.enabled = true;
+        adaptive.every = 5;
+        adaptive.split_strain = 1e-4;
+        adaptive.merge_strain = 1e-3;
+        sim.set_adaptive(adaptive);
+
+        for (int step = 0; step < 60; ++step) { sim.advance(); }
+        NCLR_CHECK(sim.escaped_particles() > 0);
+        NCLR_CHECK(sim.split_particles() > 0);
+        NCLR_CHECK(sim.merged_particles() > 0);
+
+        NCLR_CHECK(sim.rotations().size() == sim.particles().size());
+        NCLR_CHECK(sim.deformations().size() == sim.particles().size());
+        real error = 0;
+        for (std::size_t pp = 0; pp < sim.deformations().size() && pp < sim.rotations().size(); ++pp) {
+            Matrix<real, dim> R, S;
+            nclr_polar<dim>(sim.deformations()[pp], R, S);
+            error = std::max(error, (sim.rotations()[pp] - R).cwiseAbs().maxCoeff());
+        }
+        NCLR_CHECK_CLOSE(error, 0, 1e-4);
+    }
+
+    auto check_liquid() -> void {
+        std::vector<Particle<2>> particles;
+        for (const auto &x : cube<2>(8, 0.4, 0.6)) { particles.emplace_back(x, 0); }
+        MPMSimulation<2> sim(particles, MaterialModel::kLiquid, 32);
+        for (int step = 0; step < 5; ++step) { sim.advance(); }
+        NCLR_CHECK(sim.rotations().empty());
+        NCLR_CHECK(sim.deformations().empty());
+    }
+}// namespace
+
+int main() {
+    check_rotations<2>(nclr::MaterialModel::kSnow);
+    check_rotations<2>(nclr::MaterialModel::kJelly);
+    check_rotations<3>(nclr::MaterialModel::kSnow);
+    check_rotations<3>(nclr::MaterialModel::kJelly);
+    check_liquid();
+    return nclr::test::result();
+}
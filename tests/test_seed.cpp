@@ -0,0 +1,47 @@
+#include "nclr_seed.h"
+#include "nclr_test.h"
+#include <map>
+#include <vector>
+
+namespace {
+    using namespace nclr;
+
+    // Jittered seeding of a box that covers whole cells puts exactly ppc samples in every cell, whatever ppc is
+    template<int dim>
+    auto check_jittered(const int ppc) -> void {
+        constexpr real kDx = 0.125;
+        constexpr int kCells = 4;
+        const auto shape = box<dim>(constvec<dim>(0.5), constvec<dim>(kCells * kDx / 2));
+        const auto positions = seed<dim>(shape, SeedPattern::kJittered, kDx, ppc, 7, 2);
+
+        std::map<std::vector<int>, int> counts;
+        for (const auto &x : positions) {
+            std::vector<int> cell(dim);
+            for (int dd = 0; dd < dim; ++dd) { cell[dd] = int(std::floor((x(dd) - (0.5 - kCells * kDx / 2)) / kDx)); }
+            ++counts[cell];
+        }
+        std::size_t cells = 1;
+        for (int dd = 0; dd < dim; ++dd) { cells *= kCells; }
+        NCLR_CHECK(counts.size() == cells);
+        for (const auto &[cell, count] : counts) { NCLR_CHECK(count == ppc); }
+
+        // The same particles for any thread count
+        NCLR_CHECK(seed<dim>(shape, SeedPattern::kJittered, kDx, ppc, 7, 1) == positions);
+    }
+}// namespace
+
+int main() {
+    for (const int ppc : {1, 2, 3, 4, 8, 9}) {
+        check_jittered<2>(ppc);
+        check_jittered<3>(ppc);
+    }
+
+    // cube() fills its lattice the same way in parallel
+    const auto points = nclr::cube<3>(20, 0.2, 0.4, 3);
+    NCLR_CHECK(points.size() == 20 * 20 * 20);
+    NCLR_CHECK(points.front() == nclr::constvec<3>(0.2));
+    NCLR_CHECK_CLOSE(points[20 * 20 + 1](0), 0.2 + 0.2 / 19, 1e-6);
+    NCLR_CHECK_CLOSE(points[20 * 20 + 1](2), 0.2 + 0.2 / 19, 1e-6);
+    NCLR_CHECK((points.back() - nclr::constvec<3>(0.4)).norm() < 1e-6);
+    return nclr::test::result();
+}
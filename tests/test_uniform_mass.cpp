@@ -0,0 +1,36 @@
+#include "nclr.h"
+#include "nclr_test.h"
+#include <stdexcept>
+#include <vector>
+
+// Steps a NCLR_UNIFORM_MASS build and checks that adaptive resolution, which changes masses, is refused
+int main() {
+    using namespace nclr;
+
+    std::vector<Particle<2>> particles;
+    for (const auto &x : cube<2>(10, 0.45, 0.55)) { particles.emplace_back(x, 0); }
+    MPMSimulation<2> sim(particles, MaterialModel::kJelly, 32);
+    sim.add_source(Source<2>{Vector<real, 2>(0.5, 0.7), constvec<2>(0.02), constvec<2>(0), 4, 0});
+    for (int step = 0; step < 5; ++step) { sim.advance(); }
+
+    // Sources emit at the start of a step, so the last grid holds every particle at the shared constant mass
+    NCLR_CHECK(sim.particles().size() == particles.size() + 5 * 4);
+    real grid_mass = 0;
+    for (const auto &cell : sim.grid()) { grid_mass += cell.mass; }
+    NCLR_CHECK_CLOSE(grid_mass, sim.particles().size() * Particle<2>::mass, 1e-2);
+
+    bool threw = false;
+    AdaptiveSettings adaptive;
+    adaptive.enabled = true;
+    try {
+        sim.set_adaptive(adaptive);
+    } catch (const std::runtime_error &) { threw = true; }
+    NCLR_CHECK(threw);
+
+    // Turning it off is still fine
+    adaptive.enabled = false;
+    sim.set_adaptive(adaptive);
+    sim.advance();
+
+    return test::result();
+}